@@ -56,6 +56,9 @@
 //  for a very long time. The default value is one loop, but you can change it
 //  with -boguscf-loop=[value]. Value must be an integer greater than 1,
 //  otherwise the default value is taken. Exemple: -boguscf -boguscf-loop=2
+//  To keep the growth linear, -bcf_loop_origonly restricts the later loops to
+//  the blocks holding the original instructions, and -bcf_max_blocks stops
+//  the pass once a function reaches the given number of basic blocks.
 //
 //
 //  Defined debug types:
@@ -94,10 +97,12 @@
 #include "llvm/Transforms/Obfuscation/BogusControlFlow.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Transforms/Obfuscation/CryptoUtils.h"
 #include "llvm/Transforms/Obfuscation/Utils.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
 
 using namespace llvm;
@@ -117,6 +122,17 @@ static cl::opt<int>
              cl::desc("Choose how many time the -bcf pass loop on a function"),
              cl::value_desc("number of times"), cl::init(defaultObfTime),
              cl::Optional);
+static cl::opt<bool> ObfOriginalBlocksOnly(
+    "bcf_loop_origonly",
+    cl::desc("Only apply -bcf_loop iterations after the first to the blocks "
+             "of the original function, not to the blocks added by previous "
+             "iterations"),
+    cl::value_desc("original blocks only"), cl::init(false), cl::Optional);
+static cl::opt<uint32_t> MaxNumberOfBlocks(
+    "bcf_max_blocks",
+    cl::desc("Stop adding bogus flow once a function reaches this many basic "
+             "blocks. 0 means no limit"),
+    cl::value_desc("number of blocks"), cl::init(0), cl::Optional);
 static cl::opt<int> ConditionExpressionComplexity(
     "bcf_cond_compl",
     cl::desc("The complexity of the expression used to generate branching "
@@ -143,6 +159,18 @@ static cl::opt<int> MinNumberOfJunkAssembly(
 static cl::opt<bool> CreateFunctionForOpaquePredicate(
     "bcf_createfunc", cl::desc("Create function for each opaque predicate"),
     cl::value_desc("create function"), cl::init(false), cl::Optional);
+static cl::opt<uint32_t> OpaquePredicatePoolSize(
+    "bcf_createfunc_poolsize",
+    cl::desc("Share this many parameterised opaque predicate functions "
+             "across the module instead of creating one function per opaque "
+             "predicate. 0 disables pooling"),
+    cl::value_desc("pool size"), cl::init(0), cl::Optional);
+static cl::opt<int> OpaquePredicateInlineThreshold(
+    "bcf_createfunc_inline",
+    cl::desc("Pooled opaque predicate functions with at most this many "
+             "instructions are always inlined, larger ones are never inlined. "
+             "-1 leaves the decision to the inliner"),
+    cl::value_desc("instruction count"), cl::init(-1), cl::Optional);
 
 static const Instruction::BinaryOps ops[] = {
     Instruction::Add, Instruction::Sub, Instruction::And, Instruction::Or,
@@ -181,6 +209,8 @@ struct BogusControlFlow : public FunctionPass {
   static char ID; // Pass identification
   bool flag;
   std::vector<ICmpInst *> needtoedit;
+  std::vector<Function *> opaquePredicatePool;
+  std::vector<GlobalValue *> predicateGlobals;
   BogusControlFlow() : FunctionPass(ID) { this->flag = true; }
   BogusControlFlow(bool flag) : FunctionPass(ID) { this->flag = flag; }
   /* runOnFunction
@@ -222,22 +252,42 @@ struct BogusControlFlow : public FunctionPass {
 
   void bogus(Function &F) {
     int NumObfTimes = ObfTimes;
+    // Blocks holding the instructions of the original function, updated as
+    // addBogusFlow moves those instructions into new blocks
+    std::vector<BasicBlock *> originalBlocks;
+    uint32_t NumBlocks = 0;
+    for (BasicBlock &BB : F) {
+      if (!BB.isEHPad() && !BB.isLandingPad() && !containsSwiftError(&BB))
+        originalBlocks.emplace_back(&BB);
+      NumBlocks++;
+    }
 
     // Real begining of the pass
     // Loop for the number of time we run the pass on the function
     do {
       // Put all the function's block in a list
       std::list<BasicBlock *> basicBlocks;
-      for (BasicBlock &BB : F)
-        if (!BB.isEHPad() && !BB.isLandingPad() && !containsSwiftError(&BB))
-          basicBlocks.emplace_back(&BB);
+      if (ObfOriginalBlocksOnly)
+        basicBlocks.assign(originalBlocks.begin(), originalBlocks.end());
+      else
+        for (BasicBlock &BB : F)
+          if (!BB.isEHPad() && !BB.isLandingPad() && !containsSwiftError(&BB))
+            basicBlocks.emplace_back(&BB);
 
       while (!basicBlocks.empty()) {
+        // Each bogus flow adds three blocks
+        if (MaxNumberOfBlocks && NumBlocks + 3 > MaxNumberOfBlocks)
+          return;
         // Basic Blocks' selection
         if ((int)cryptoutils->get_range(100) <= ObfProbRate) {
           // Add bogus flow to the given Basic Block (see description)
           BasicBlock *basicBlock = basicBlocks.front();
-          addBogusFlow(basicBlock, F);
+          if (BasicBlock *originalBB = addBogusFlow(basicBlock, F)) {
+            NumBlocks += 3;
+            if (ObfOriginalBlocksOnly)
+              std::replace(originalBlocks.begin(), originalBlocks.end(),
+                           basicBlock, originalBB);
+          }
         }
         // remove the block from the list
         basicBlocks.pop_front();
@@ -256,9 +306,10 @@ struct BogusControlFlow : public FunctionPass {
   /* addBogusFlow
    *
    * Add bogus flow to a given basic block, according to the header's
-   * description
+   * description. Returns the block the original instructions were moved to,
+   * or nullptr if the block was left untouched.
    */
-  void addBogusFlow(BasicBlock *basicBlock, Function &F) {
+  BasicBlock *addBogusFlow(BasicBlock *basicBlock, Function &F) {
 
     // Split the block: first part with only the phi nodes and debug info and
     // terminator
@@ -289,7 +340,7 @@ struct BogusControlFlow : public FunctionPass {
       // If there are no other kind of instruction we just don't split that
       // entry block
       if (i1 == basicBlock->end())
-        return;
+        return nullptr;
     }
 
     BasicBlock *originalBB = basicBlock->splitBasicBlock(i1, "originalBB");
@@ -359,6 +410,7 @@ struct BogusControlFlow : public FunctionPass {
     default:
       llvm_unreachable("wtf?");
     }
+    return originalBB;
   } // end of addBogusFlow()
 
   /* createAlteredBasicBlock
@@ -610,12 +662,14 @@ struct BogusControlFlow : public FunctionPass {
       InlineAsm *IA = InlineAsm::get(
           FunctionType::get(Type::getVoidTy(alteredBB->getContext()), false),
           junk, "", true, false);
-#if LLVM_VERSION_MAJOR >= 16
-      CallInst::Create(IA, std::nullopt, "", &*alteredBB->getFirstInsertionPt());
-#else
-      CallInst::Create(IA, None, "", &*alteredBB->getFirstInsertionPt());
-#endif
-      turnOffOptimization(basicBlock->getParent());
+      // alteredBB is still empty with -bcf_onlyjunkasm
+      IRBuilder<> IRB(alteredBB, alteredBB->getFirstInsertionPt());
+      CallInst *JunkCI = IRB.CreateCall(IA->getFunctionType(), IA);
+      // Instead of disabling optimization for the whole function, forbid
+      // duplicating the data into other blocks. Together with the cold
+      // branch weights and the pinned predicate globals set up in doF() this
+      // keeps the data inside the never executed altered block.
+      JunkCI->addFnAttr(Attribute::AttrKind::NoDuplicate);
     }
     return alteredBB;
   } // end of createAlteredBasicBlock()
@@ -644,8 +698,19 @@ struct BogusControlFlow : public FunctionPass {
     Module &M = *F.getParent();
     Type *I1Ty = Type::getInt1Ty(M.getContext());
     Type *I32Ty = Type::getInt32Ty(M.getContext());
+    if (CreateFunctionForOpaquePredicate && OpaquePredicatePoolSize)
+      collectOpaquePredicatePool(M);
     // Replacing all the branches we found
     for (Instruction *i : toEdit) {
+      Instruction *tmp = &*(i->getParent()->getFirstNonPHIOrDbgOrLifetime());
+      IRBuilder<> *IRBReal = new IRBuilder<>(tmp);
+      Value *Last = nullptr;
+      bool predicateIsTrue = false;
+      if (CreateFunctionForOpaquePredicate && OpaquePredicatePoolSize) {
+        Last = buildPooledPredicateCall(*IRBReal, M, predicateIsTrue);
+        createBranchOnPredicate(cast<BranchInst>(i), Last, predicateIsTrue);
+        continue;
+      }
       // Previously We Use LLVM EE To Calculate LHS and RHS
       // Since IRBuilder<> uses ConstantFolding to fold constants.
       // The return instruction is already returning constants
@@ -671,8 +736,6 @@ struct BogusControlFlow : public FunctionPass {
         writeAnnotate(opFunction, "bcfopfunc");
         IRBOp = new IRBuilder<>(opEntryBlock);
       }
-      Instruction *tmp = &*(i->getParent()->getFirstNonPHIOrDbgOrLifetime());
-      IRBuilder<> *IRBReal = new IRBuilder<>(tmp);
       IRBuilder<> IRBEmu(emuEntryBlock);
       // First,Construct a real RHS that will be used in the actual condition
       Constant *RealRHS = ConstantInt::get(I32Ty, cryptoutils->get_uint32_t());
@@ -687,6 +750,8 @@ struct BogusControlFlow : public FunctionPass {
       GlobalVariable *RHSGV =
           new GlobalVariable(M, Type::getInt32Ty(M.getContext()), false,
                              GlobalValue::PrivateLinkage, RHSC, "RHSGV");
+      predicateGlobals.emplace_back(LHSGV);
+      predicateGlobals.emplace_back(RHSGV);
       LoadInst *LHS =
           (CreateFunctionForOpaquePredicate ? IRBOp : IRBReal)
               ->CreateLoad(LHSGV->getValueType(), LHSGV, "Initial LHS");
@@ -701,8 +766,8 @@ struct BogusControlFlow : public FunctionPass {
           ops[cryptoutils->get_range(sizeof(ops) / sizeof(ops[0]))];
       Value *emuLast =
           IRBEmu.CreateBinOp(initialOp, emuLHS, emuRHS, "EmuInitialCondition");
-      Value *Last = (CreateFunctionForOpaquePredicate ? IRBOp : IRBReal)
-                        ->CreateBinOp(initialOp, LHS, RHS, "InitialCondition");
+      Last = (CreateFunctionForOpaquePredicate ? IRBOp : IRBReal)
+                 ->CreateBinOp(initialOp, LHS, RHS, "InitialCondition");
       for (int i = 0; i < ConditionExpressionComplexity; i++) {
         Constant *newTmp =
             ConstantInt::get(I32Ty, cryptoutils->get_range(1, UINT32_MAX));
@@ -724,26 +789,224 @@ struct BogusControlFlow : public FunctionPass {
       emuLast = IRBEmu.CreateICmp(pred, emuLast, RealRHS);
       ReturnInst *RI = IRBEmu.CreateRet(emuLast);
       ConstantInt *emuCI = cast<ConstantInt>(RI->getReturnValue());
-      APInt emulateResult = emuCI->getValue();
-      if (emulateResult == 1) {
-        // Our ConstantExpr evaluates to true;
-        BranchInst::Create(((BranchInst *)i)->getSuccessor(0),
-                           ((BranchInst *)i)->getSuccessor(1), Last,
-                           i->getParent());
-      } else {
-        // False, swap operands
-        BranchInst::Create(((BranchInst *)i)->getSuccessor(1),
-                           ((BranchInst *)i)->getSuccessor(0), Last,
-                           i->getParent());
-      }
+      predicateIsTrue = emuCI->isOne();
       emuFunction->eraseFromParent();
-      i->eraseFromParent(); // erase the branch
+      createBranchOnPredicate(cast<BranchInst>(i), Last, predicateIsTrue);
     }
     // Erase all the associated conditions we found
     for (Instruction *i : toDelete)
       i->eraseFromParent();
+    // Don't let the optimizer fold the predicates and drop the junk assembly
+    if ((JunkAssembly || OnlyJunkAssembly) && !predicateGlobals.empty())
+      appendToCompilerUsed(M, predicateGlobals);
+    // Those of earlier functions are already in llvm.compiler.used
+    predicateGlobals.clear();
     return true;
   } // end of doFinalization
+
+  /* createBranchOnPredicate
+   *
+   * Replace the placeholder branch with one on the obfuscated predicate,
+   * swapping the successors if the predicate always evaluates to false.
+   */
+  void createBranchOnPredicate(BranchInst *br, Value *pred, bool isTrue) {
+    BranchInst *newBr = nullptr;
+    if (isTrue) {
+      // Our ConstantExpr evaluates to true;
+      newBr = BranchInst::Create(br->getSuccessor(0), br->getSuccessor(1),
+                                 pred, br->getParent());
+    } else {
+      // False, swap operands
+      newBr = BranchInst::Create(br->getSuccessor(1), br->getSuccessor(0),
+                                 pred, br->getParent());
+    }
+    // Junk assembly is data, lay the bogus successor out as a cold block
+    if (JunkAssembly || OnlyJunkAssembly)
+      newBr->setMetadata(
+          LLVMContext::MD_prof,
+          MDBuilder(br->getContext())
+              .createBranchWeights(isTrue ? UINT16_MAX : 1,
+                                   isTrue ? 1 : UINT16_MAX));
+    br->eraseFromParent(); // erase the branch
+  }
+
+  /* collectOpaquePredicatePool
+   *
+   * Pooled predicates outlive a single run of this pass, so pick up the ones
+   * created while obfuscating previous functions of the module. Retired ones
+   * are renamed and no longer match.
+   */
+  void collectOpaquePredicatePool(Module &M) {
+    opaquePredicatePool.clear();
+    FunctionType *FTy = getPooledPredicateType(M.getContext());
+    for (Function &PF : M)
+      if (PF.getName().startswith("HikariBCFOpaquePredicatePool") &&
+          PF.getFunctionType() == FTy && !PF.isDeclaration())
+        opaquePredicatePool.emplace_back(&PF);
+  }
+
+  FunctionType *getPooledPredicateType(LLVMContext &C) {
+    // LHS, RHS, one constant per complexity level and the real RHS
+    std::vector<Type *> Params(std::max((int)ConditionExpressionComplexity, 0) + 3,
+                               Type::getInt32Ty(C));
+    return FunctionType::get(Type::getInt1Ty(C), Params, false);
+  }
+
+  /* createPooledPredicate
+   *
+   * Create a predicate function whose operators and comparison are fixed
+   * but whose operands are supplied by each call site, so that a handful of
+   * functions can serve every opaque predicate of the module.
+   */
+  Function *createPooledPredicate(Module &M) {
+    FunctionType *FTy = getPooledPredicateType(M.getContext());
+    Function *PF =
+        Function::Create(FTy, GlobalValue::LinkageTypes::PrivateLinkage,
+                         "HikariBCFOpaquePredicatePool", M);
+    BasicBlock *TrampBlock = BasicBlock::Create(M.getContext(), "", PF);
+    BasicBlock *EntryBlock = BasicBlock::Create(M.getContext(), "", PF);
+    // Insert a br to make it can be obfuscated by IndirectBranch
+    BranchInst::Create(EntryBlock, TrampBlock);
+    IRBuilder<> IRB(EntryBlock);
+    Value *Last =
+        IRB.CreateBinOp(ops[cryptoutils->get_range(sizeof(ops) / sizeof(ops[0]))],
+                        PF->getArg(0), PF->getArg(1), "InitialCondition");
+    for (unsigned i = 2; i < PF->arg_size() - 1; i++)
+      Last = IRB.CreateBinOp(
+          ops[cryptoutils->get_range(sizeof(ops) / sizeof(ops[0]))], Last,
+          PF->getArg(i), "InitialCondition");
+    IRB.CreateRet(IRB.CreateICmp(
+        preds[cryptoutils->get_range(sizeof(preds) / sizeof(preds[0]))], Last,
+        PF->getArg(PF->arg_size() - 1)));
+    writeAnnotate(PF, "bcfopfunc");
+    if (OpaquePredicateInlineThreshold >= 0) {
+      if (PF->getInstructionCount() <=
+          (unsigned)OpaquePredicateInlineThreshold)
+        PF->addFnAttr(Attribute::AttrKind::AlwaysInline);
+      else
+        PF->addFnAttr(Attribute::AttrKind::NoInline);
+    }
+    opaquePredicatePool.emplace_back(PF);
+    return PF;
+  }
+
+  /* emulatePooledPredicate
+   *
+   * Evaluate a pooled predicate for constant arguments. Returns false if the
+   * body contains something we can not emulate, e.g. because another pass
+   * already transformed it.
+   */
+  bool emulatePooledPredicate(Function *PF, ArrayRef<ConstantInt *> Args,
+                              bool &Result) {
+    std::map<Value *, APInt> Vals;
+    for (Argument &Arg : PF->args())
+      Vals[&Arg] = Args[Arg.getArgNo()]->getValue();
+    auto getVal = [&](Value *V, APInt &Out) {
+      if (ConstantInt *CI = dyn_cast<ConstantInt>(V)) {
+        Out = CI->getValue();
+        return true;
+      }
+      if (Vals.find(V) == Vals.end())
+        return false;
+      Out = Vals[V];
+      return true;
+    };
+    BasicBlock *BB = &PF->getEntryBlock();
+    std::set<BasicBlock *> Visited;
+    while (BB && Visited.insert(BB).second) {
+      BasicBlock *Next = nullptr;
+      for (Instruction &I : *BB) {
+        APInt L, R;
+        if (BinaryOperator *BO = dyn_cast<BinaryOperator>(&I)) {
+          if (!getVal(BO->getOperand(0), L) || !getVal(BO->getOperand(1), R))
+            return false;
+          switch (BO->getOpcode()) {
+          case Instruction::Add:
+            Vals[BO] = L + R;
+            break;
+          case Instruction::Sub:
+            Vals[BO] = L - R;
+            break;
+          case Instruction::And:
+            Vals[BO] = L & R;
+            break;
+          case Instruction::Or:
+            Vals[BO] = L | R;
+            break;
+          case Instruction::Xor:
+            Vals[BO] = L ^ R;
+            break;
+          case Instruction::Mul:
+            Vals[BO] = L * R;
+            break;
+          case Instruction::UDiv:
+            if (R.isZero())
+              return false;
+            Vals[BO] = L.udiv(R);
+            break;
+          default:
+            return false;
+          }
+        } else if (ICmpInst *ICI = dyn_cast<ICmpInst>(&I)) {
+          if (!getVal(ICI->getOperand(0), L) || !getVal(ICI->getOperand(1), R))
+            return false;
+          Vals[ICI] = APInt(1, ICmpInst::compare(L, R, ICI->getPredicate()));
+        } else if (ReturnInst *RI = dyn_cast<ReturnInst>(&I)) {
+          if (!RI->getReturnValue() || !getVal(RI->getReturnValue(), L))
+            return false;
+          Result = L.getBoolValue();
+          return true;
+        } else if (BranchInst *BI = dyn_cast<BranchInst>(&I)) {
+          if (BI->isConditional())
+            return false;
+          Next = BI->getSuccessor(0);
+        } else
+          return false;
+      }
+      BB = Next;
+    }
+    return false;
+  }
+
+  /* buildPooledPredicateCall
+   *
+   * Pooled counterpart of the per-predicate functions: emit a call to a
+   * randomly chosen pooled predicate with fresh per-site constants.
+   */
+  Value *buildPooledPredicateCall(IRBuilder<> &IRB, Module &M,
+                                  bool &predicateIsTrue) {
+    Type *I32Ty = Type::getInt32Ty(M.getContext());
+    uint32_t idx = cryptoutils->get_range(OpaquePredicatePoolSize);
+    Function *PF = idx < opaquePredicatePool.size() ? opaquePredicatePool[idx]
+                                                    : createPooledPredicate(M);
+    std::vector<ConstantInt *> EmuArgs;
+    for (unsigned i = 0; i < PF->arg_size() - 1; i++)
+      EmuArgs.emplace_back(
+          ConstantInt::get(Type::getInt32Ty(M.getContext()),
+                           cryptoutils->get_range(1, UINT32_MAX)));
+    EmuArgs.emplace_back(ConstantInt::get(
+        Type::getInt32Ty(M.getContext()), cryptoutils->get_uint32_t()));
+    if (!emulatePooledPredicate(PF, EmuArgs, predicateIsTrue)) {
+      // Someone rewrote this one, stop handing it out, also to the instances
+      // of this pass obfuscating the next functions
+      opaquePredicatePool.erase(std::find(opaquePredicatePool.begin(),
+                                          opaquePredicatePool.end(), PF));
+      PF->setName("HikariBCFRetiredOpaquePredicate");
+      PF = createPooledPredicate(M);
+      emulatePooledPredicate(PF, EmuArgs, predicateIsTrue);
+    }
+    // LHS and RHS must not be visible to the optimizer
+    GlobalVariable *LHSGV = new GlobalVariable(
+        M, I32Ty, false, GlobalValue::PrivateLinkage, EmuArgs[0], "LHSGV");
+    GlobalVariable *RHSGV = new GlobalVariable(
+        M, I32Ty, false, GlobalValue::PrivateLinkage, EmuArgs[1], "RHSGV");
+    predicateGlobals.emplace_back(LHSGV);
+    predicateGlobals.emplace_back(RHSGV);
+    std::vector<Value *> Args(EmuArgs.begin(), EmuArgs.end());
+    Args[0] = IRB.CreateLoad(LHSGV->getValueType(), LHSGV, "Initial LHS");
+    Args[1] = IRB.CreateLoad(RHSGV->getValueType(), RHSGV, "Initial RHS");
+    return IRB.CreateCall(PF, Args);
+  }
 };  // end of struct BogusControlFlow : public FunctionPass
 } // namespace llvm
 
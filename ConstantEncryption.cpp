@@ -16,7 +16,10 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "llvm/Transforms/Obfuscation/ConstantEncryption.h"
+#include "llvm/ADT/PointerUnion.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
@@ -40,6 +43,12 @@ static cl::opt<bool>
               cl::desc("Replace ConstantInt with GlobalVariable"),
               cl::value_desc("ConstantInt to GlobalVariable"), cl::init(false),
               cl::Optional);
+static cl::opt<bool> HoistDecoding(
+    "constenc_hoist",
+    cl::desc("Decode each constant once per region, the outermost loop with "
+             "a preheader around its uses or else their basic block, with one "
+             "key and reuse it there. Loops decode in their preheaders"),
+    cl::init(false), cl::Optional);
 static cl::opt<unsigned int>
     ObfProbRate("constenc_prob",
                 cl::desc("Choose the probability [%] each instructions will be "
@@ -76,8 +85,15 @@ struct ConstantEncryption : public ModulePass {
     for (Function &F : M)
       if (toObfuscate(flag, &F, "constenc") && !F.isPresplitCoroutine()) {
         errs() << "Running ConstantEncryption On " << F.getName() << "\n";
+        std::unique_ptr<DominatorTree> DT;
+        std::unique_ptr<LoopInfo> LI;
+        if (HoistDecoding) {
+          DT = std::make_unique<DominatorTree>(F);
+          LI = std::make_unique<LoopInfo>(*DT);
+        }
         int times = ObfTimes;
         while (times) {
+          std::vector<std::pair<Instruction *, unsigned>> operands;
           for (Instruction &I : instructions(F)) {
             if (!shouldEncryptConstant(&I))
               continue;
@@ -85,8 +101,12 @@ struct ConstantEncryption : public ModulePass {
               if (isa<SwitchInst>(&I) && i != 0)
                 break;
               Value *Op = I.getOperand(i);
-              if (isa<ConstantInt>(Op))
-                HandleConstantIntOperand(&I, i);
+              if (isa<ConstantInt>(Op)) {
+                if (HoistDecoding)
+                  operands.emplace_back(&I, i);
+                else
+                  HandleConstantIntOperand(&I, i);
+              }
               if (GlobalVariable *G =
                       dyn_cast<GlobalVariable>(Op->stripPointerCasts()))
                 if (G->hasInitializer() &&
@@ -95,25 +115,26 @@ struct ConstantEncryption : public ModulePass {
                   HandleConstantIntInitializerGV(G);
             }
           }
+          // Decodings are only placed once the walk above is done, they can
+          // land in preheaders it has not visited yet
+          if (HoistDecoding)
+            HandleConstantIntOperandsByRegion(operands, *LI);
           if (ConstToGV) {
             std::vector<Instruction *> ins;
+            std::vector<Use *> pooled;
             for (Instruction &I : instructions(F)) {
               if (!shouldEncryptConstant(&I))
                 continue;
               for (unsigned int i = 0; i < I.getNumOperands(); i++)
-                if (ConstantInt *CI = dyn_cast<ConstantInt>(I.getOperand(i))) {
+                if (isa<ConstantInt>(I.getOperand(i))) {
                   if (isa<SwitchInst>(&I) && i != 0)
                     break;
-                  GlobalVariable *GV = new GlobalVariable(
-                      M, CI->getType(), false,
-                      GlobalValue::LinkageTypes::PrivateLinkage,
-                      ConstantInt::get(CI->getType(), CI->getValue()),
-                      "ConstantEncryptionConstToGlobal");
-                  appendToCompilerUsed(M, GV);
-                  I.setOperand(i, new LoadInst(GV->getValueType(), GV, "", &I));
+                  pooled.emplace_back(&I.getOperandUse(i));
                 }
               ins.emplace_back(&I);
             }
+            if (!pooled.empty())
+              PoolConstantInts(M, pooled);
             for (Instruction *I : ins) {
               if (BinaryOperator *BO = dyn_cast<BinaryOperator>(I)) {
                 if (!BO->getType()->isIntegerTy())
@@ -156,7 +177,47 @@ struct ConstantEncryption : public ModulePass {
     return true;
   }
 
+  /* PoolConstantInts
+   *
+   * Replace the constants of Uses with loads from one private table. Every
+   * distinct constant, which covers both halves of an encrypted operand, is
+   * stored once and in the order of its first use so that constants used
+   * together share cache lines.
+   */
+  void PoolConstantInts(Module &M, std::vector<Use *> &Uses) {
+    std::map<ConstantInt *, unsigned> Index;
+    std::vector<Constant *> Entries;
+    std::vector<Type *> Types;
+    for (Use *U : Uses) {
+      ConstantInt *CI = cast<ConstantInt>(U->get());
+      if (Index.emplace(CI, Entries.size()).second) {
+        Entries.emplace_back(CI);
+        Types.emplace_back(CI->getType());
+      }
+    }
+    StructType *ST = StructType::get(M.getContext(), Types);
+    GlobalVariable *GV = new GlobalVariable(
+        M, ST, false, GlobalValue::LinkageTypes::PrivateLinkage,
+        ConstantStruct::get(ST, Entries), "ConstantEncryptionConstToGlobal");
+    appendToCompilerUsed(M, GV);
+    IntegerType *I32Ty = Type::getInt32Ty(M.getContext());
+    for (Use *U : Uses) {
+      ConstantInt *CI = cast<ConstantInt>(U->get());
+      Constant *Indices[] = {ConstantInt::get(I32Ty, 0),
+                             ConstantInt::get(I32Ty, Index[CI])};
+      Constant *Ptr = ConstantExpr::getInBoundsGetElementPtr(ST, GV, Indices);
+      U->set(new LoadInst(CI->getType(), Ptr, "",
+                          cast<Instruction>(U->getUser())));
+    }
+  }
+
   void HandleConstantIntInitializerGV(GlobalVariable *GVPtr) {
+    // Only loads and stores can be fixed up, e.g. a cmpxchg or a callee would
+    // see the encrypted value
+    for (User *U : GVPtr->users())
+      if (!(isa<LoadInst>(U) ||
+            (isa<StoreInst>(U) && U->getOperand(1) == GVPtr)))
+        return;
     // Prepare Types and Keys
     ConstantInt *CI = dyn_cast<ConstantInt>(GVPtr->getInitializer());
     std::pair<ConstantInt * /*key*/, ConstantInt * /*new*/> keyandnew =
@@ -198,6 +259,52 @@ struct ConstantEncryption : public ModulePass {
       SubstituteImpl::substituteXor(NewOperand);
   }
 
+  /* HandleConstantIntOperandsByRegion
+   *
+   * Like HandleConstantIntOperand, but a constant is decoded only once per
+   * region with a key of that region. Uses inside loops are decoded in the
+   * preheader of the outermost loop that has one, so loop bodies only see the
+   * decoded value, and uses elsewhere share the decoding of their basic block.
+   */
+  void HandleConstantIntOperandsByRegion(
+      std::vector<std::pair<Instruction *, unsigned>> &Operands, LoopInfo &LI) {
+    std::map<std::pair<PointerUnion<Loop *, BasicBlock *>, ConstantInt *>,
+             Instruction *>
+        Decoded;
+    std::vector<BinaryOperator *> decodings;
+    for (std::pair<Instruction *, unsigned> &Operand : Operands) {
+      Instruction *I = Operand.first;
+      unsigned opindex = Operand.second;
+      ConstantInt *CI = cast<ConstantInt>(I->getOperand(opindex));
+      PointerUnion<Loop *, BasicBlock *> Region = I->getParent();
+      // Uses come in program order, so the first one of a block dominates the
+      // others in it
+      Instruction *InsertBefore = I;
+      for (Loop *L = LI.getLoopFor(I->getParent()); L; L = L->getParentLoop())
+        if (BasicBlock *Preheader = L->getLoopPreheader()) {
+          Region = L;
+          InsertBefore = Preheader->getTerminator();
+        }
+      Instruction *&NewOperand = Decoded[std::make_pair(Region, CI)];
+      if (!NewOperand) {
+        std::pair<ConstantInt * /*key*/, ConstantInt * /*new*/> keyandnew =
+            PairConstantInt(CI);
+        ConstantInt *Key = keyandnew.first;
+        ConstantInt *New = keyandnew.second;
+        if (!Key || !New)
+          continue;
+        NewOperand = BinaryOperator::Create(Instruction::Xor, New, Key, "",
+                                            InsertBefore);
+        decodings.emplace_back(cast<BinaryOperator>(NewOperand));
+      }
+      I->setOperand(opindex, NewOperand);
+    }
+    // Substitution replaces the uses of a decoding, it has to see all of them
+    if (SubstituteXor)
+      for (BinaryOperator *BO : decodings)
+        SubstituteImpl::substituteXor(BO);
+  }
+
   std::pair<ConstantInt * /*key*/, ConstantInt * /*new*/>
   PairConstantInt(ConstantInt *C) {
     IntegerType *IT = cast<IntegerType>(C->getType());
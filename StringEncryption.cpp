@@ -2,15 +2,25 @@
 // [License](https://github.com/HikariObfuscator/Hikari/wiki/License).
 //===----------------------------------------------------------------------===//
 #include "llvm/Transforms/Obfuscation/StringEncryption.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicsAArch64.h"
+#include "llvm/IR/IntrinsicsX86.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/NoFolder.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/Obfuscation/CryptoUtils.h"
 #include "llvm/Transforms/Obfuscation/Obfuscation.h"
 #include "llvm/Transforms/Obfuscation/Utils.h"
+#include "llvm/Transforms/Utils/BuildLibCalls.h"
 
 using namespace llvm;
 
@@ -19,6 +29,77 @@ static cl::opt<uint32_t>
                        cl::desc("Choose the probability [%] each element of "
                                 "ConstantDataSequential will be "
                                 "obfuscated by the -strcry pass"));
+static cl::opt<uint32_t> LoopThreshold(
+    "strcry_loop", cl::init(0), cl::NotHidden,
+    cl::desc("Decrypt strings of at least this many elements with a call to a "
+             "shared vectorizable loop instead of unrolled code. 0 disables"),
+    cl::value_desc("number of elements"));
+static cl::opt<uint32_t> CompressThreshold(
+    "strcry_compress", cl::init(0), cl::NotHidden,
+    cl::desc("Compress strings of at least this many bytes before encrypting "
+             "them and decompress them into a zero initialized decrypt "
+             "space. 0 disables"),
+    cl::value_desc("number of bytes"));
+static cl::opt<uint32_t> ChunkThreshold(
+    "strcry_chunked", cl::init(0), cl::NotHidden,
+    cl::desc("Decrypt strings of at least this many bytes a chunk at a time "
+             "right before the instructions accessing them, behind a status of "
+             "each chunk, instead of all at once. 0 disables"),
+    cl::value_desc("number of bytes"));
+static cl::opt<uint32_t> ChunkSize(
+    "strcry_chunk_size", cl::init(4096), cl::NotHidden,
+    cl::desc("Size of the chunks of -strcry_chunked, a power of two of at "
+             "least 4"),
+    cl::value_desc("number of bytes"));
+static cl::opt<uint32_t> StackThreshold(
+    "strcry_stack", cl::init(0), cl::NotHidden,
+    cl::desc("Decrypt constant strings of less than this many bytes that are "
+             "only used by one function and don't escape it into a buffer on "
+             "its stack right before their uses, instead of into a decrypt "
+             "space behind a status. 0 disables"),
+    cl::value_desc("number of bytes"));
+static cl::opt<bool> KeystreamKeys(
+    "strcry_keystream", cl::init(false), cl::NotHidden,
+    cl::desc("Derive the keys of every string from a 32 bit seed at runtime "
+             "instead of storing them. Encrypts all elements regardless of "
+             "-strcry_prob"));
+static cl::opt<bool> ChaChaKeys(
+    "strcry_chacha", cl::init(false), cl::NotHidden,
+    cl::desc("Encrypt strings with the ChaCha20 keystream of a key of the "
+             "module and a nonce of every string instead of XOR keys. "
+             "Encrypts all elements regardless of -strcry_prob"));
+static cl::opt<bool> InPlace(
+    "strcry_inplace", cl::init(false), cl::NotHidden,
+    cl::desc("Decrypt every string in place in its writable encrypted copy "
+             "instead of into a separate decrypt space. Every string gets its "
+             "own status"));
+static cl::opt<bool> PackStrings(
+    "strcry_pack", cl::init(false), cl::NotHidden,
+    cl::desc("Pack the encrypted strings, decrypt spaces and keys of the "
+             "module into one global each instead of a few globals per "
+             "string"));
+static cl::opt<bool> EagerDecryption(
+    "strcry_eager", cl::init(false), cl::NotHidden,
+    cl::desc("Decrypt all strings once from a module constructor instead of "
+             "checking a status in the protected functions. Thread local "
+             "strings are still decrypted by the functions"));
+static cl::opt<bool> LazyDecryption(
+    "strcry_lazy", cl::init(false), cl::NotHidden,
+    cl::desc("Decrypt strings only used by the instructions of one function "
+             "right before their uses, each behind its own status, instead "
+             "of all of them at the function entry"));
+static cl::opt<bool> TrampolineDecryption(
+    "strcry_trampoline", cl::init(false), cl::NotHidden,
+    cl::desc("Decrypt the strings of a function on its first call through a "
+             "trampoline that then points the function at its plain body, "
+             "instead of checking a status on every call. Only on x86 and on "
+             "Linux for ARM, AArch64 and RISC-V"));
+static cl::opt<bool> SharedState(
+    "strcry_shared", cl::init(false), cl::NotHidden,
+    cl::desc("Share one encrypted copy, decrypt space and status of each "
+             "string among all functions using it and merge identical "
+             "constant strings. Strings used by several functions are "
+             "encrypted as long as all of them are protected"));
 
 namespace llvm {
 struct StringEncryption : public ModulePass {
@@ -28,8 +109,34 @@ struct StringEncryption : public ModulePass {
   std::map<Function * /*Function*/, GlobalVariable * /*Decryption Status*/>
       encstatus;
   std::map<GlobalVariable *, std::pair<Constant *, GlobalVariable *>> mgv2keys;
-  std::map<Constant *, std::vector<unsigned int>> unencryptedindex;
-  std::vector<GlobalVariable *> genedgv;
+  std::map<GlobalVariable * /*Decrypt Space*/, BitVector /*Unencrypted*/>
+      unencryptedindex;
+  DenseSet<GlobalVariable *> genedgv;
+  std::map<GlobalVariable * /*Decrypt Space*/, GlobalVariable * /*Keys*/>
+      decryptionkeys;
+  std::map<GlobalVariable *, std::pair<Constant *, GlobalVariable *>>
+      eagerkeys;
+  Function *decryptroutine = nullptr;
+  Function *keystreamroutines[2] = {nullptr, nullptr}; // Copying, in place
+  Function *chacharoutine = nullptr;
+  Function *decompressroutine = nullptr;
+  DenseSet<GlobalVariable * /*Decrypt Space*/> compressedstrings;
+  Function *chunkroutine = nullptr;
+  std::map<GlobalVariable * /*Decrypt Space*/, GlobalVariable * /*Status*/>
+      chunkstatus;
+  GlobalVariable *chachakey = nullptr;
+  uint32_t chachakeywords[8];
+  Function *lockroutine = nullptr;
+  Function *membarrierroutine = nullptr;
+  Function *unlockroutine = nullptr;
+  std::set<Function *> protectedfuncs;
+  std::map<GlobalVariable * /*Decrypt Space*/, GlobalVariable * /*Status*/>
+      stringstatus;
+  std::map<GlobalVariable * /*Original*/, GlobalVariable * /*Decrypt Space*/>
+      sharedstrings;
+  std::map<std::pair<Constant * /*Initializer*/, unsigned /*Address Space*/>,
+           GlobalVariable * /*Decrypt Space*/>
+      sharedliterals;
   StringEncryption() : ModulePass(ID) { this->flag = true; }
 
   StringEncryption(bool flag) : ModulePass(ID) { this->flag = flag; }
@@ -65,14 +172,41 @@ struct StringEncryption : public ModulePass {
         !(GV->getSection().contains("__objc") &&
           !GV->getSection().contains("array")) &&
         !GV->getName().contains("OBJC") &&
-        std::find(genedgv.begin(), genedgv.end(), GV) == genedgv.end() &&
+        !genedgv.count(GV) &&
         ((GV->getLinkage() == GlobalValue::LinkageTypes::PrivateLinkage ||
           GV->getLinkage() == GlobalValue::LinkageTypes::InternalLinkage) &&
-         (flag || usersAllInOneFunction(GV))))
+         (flag || usersAllInOneFunction(GV) ||
+          (SharedState && usersAllProtected(GV)))))
       return true;
     return false;
   }
 
+  bool usersAllProtected(Value *V) {
+    for (User *U : V->users())
+      if (Instruction *I = dyn_cast<Instruction>(U)) {
+        if (!protectedfuncs.count(I->getFunction()))
+          return false;
+      } else if (!isa<ConstantExpr>(U) || !usersAllProtected(U))
+        return false;
+    return true;
+  }
+
+  // The decrypt space another function already created for GV or, for
+  // constant strings whose address is insignificant, for the same literal
+  GlobalVariable *findSharedString(GlobalVariable *GV) {
+    std::map<GlobalVariable *, GlobalVariable *>::iterator iter =
+        sharedstrings.find(GV);
+    if (iter != sharedstrings.end())
+      return iter->second;
+    if (!GV->isConstant() || !GV->hasGlobalUnnamedAddr() ||
+        GV->isThreadLocal())
+      return nullptr;
+    std::map<std::pair<Constant *, unsigned>, GlobalVariable *>::iterator
+        literal = sharedliterals.find(std::make_pair(
+            GV->getInitializer(), GV->getType()->getAddressSpace()));
+    return literal != sharedliterals.end() ? literal->second : nullptr;
+  }
+
   bool runOnModule(Module &M) override {
     // in runOnModule. We simple iterate function list and dispatch functions
     // to handlers
@@ -84,24 +218,191 @@ struct StringEncryption : public ModulePass {
                 "-strcry_prob=x must be 0 < x <= 100";
       return false;
     }
+    if (ChunkThreshold && (ChunkSize < 4 || !isPowerOf2_32(ChunkSize))) {
+      errs() << "StringEncryption chunk size -strcry_chunk_size=x must be a "
+                "power of two x >= 4";
+      return false;
+    }
 
+    // Strings passed to library functions known not to keep them don't
+    // escape, as far as -strcry_stack is concerned
+    if (StackThreshold) {
+      TargetLibraryInfoImpl TLII(Triple(M.getTargetTriple()));
+      TargetLibraryInfo TLI(TLII);
+      for (Function &F : M)
+        if (F.isDeclaration())
+          inferLibFuncAttributes(F, TLI);
+    }
+
+    if (TrampolineDecryption) {
+      Triple T(M.getTargetTriple());
+      if (!T.isX86() && !getMembarrierSyscall(T))
+        errs() << "StringEncryption -strcry_trampoline is not supported on "
+               << T.str() << ", decrypting at the function entries instead\n";
+    }
+
+    // Decide on all functions first, -strcry_shared must know whether the
+    // other users of a string are protected
     for (Function &F : M)
-      if (toObfuscate(flag, &F, "strenc")) {
+      if (toObfuscate(flag, &F, "strenc"))
+        protectedfuncs.insert(&F);
+    for (Function &F : M)
+      if (protectedfuncs.count(&F)) {
         errs() << "Running StringEncryption On " << F.getName() << "\n";
-        Constant *S =
-            ConstantInt::getNullValue(Type::getInt32Ty(M.getContext()));
-        GlobalVariable *GV = new GlobalVariable(
-            M, S->getType(), false, GlobalValue::LinkageTypes::PrivateLinkage,
-            S, "StringEncryptionEncStatus");
-        encstatus[&F] = GV;
+        if (!SharedState && !InPlace && !EagerDecryption) {
+          Constant *S =
+              ConstantInt::getNullValue(Type::getInt32Ty(M.getContext()));
+          GlobalVariable *GV = new GlobalVariable(
+              M, S->getType(), false,
+              GlobalValue::LinkageTypes::PrivateLinkage, S,
+              "StringEncryptionEncStatus");
+          encstatus[&F] = GV;
+        }
         HandleFunction(&F);
       }
+    if (!eagerkeys.empty())
+      CreateDecryptionConstructor(M);
+    if (PackStrings)
+      PackGlobals(M);
     return true;
   }
 
+  /* CreateDecryptionConstructor
+   *
+   * Decrypt the strings of all protected functions from a module constructor
+   * that runs ahead of the default priority, so that the functions themselves
+   * don't have to check anything.
+   */
+  void CreateDecryptionConstructor(Module &M) {
+    LLVMContext &C = M.getContext();
+    Function *F = createRuntimeFunction(
+        &M, FunctionType::get(Type::getVoidTy(C), false),
+        "HikariStringDecryptionCtor");
+    BasicBlock *B = BasicBlock::Create(C, "StringDecryptionBB", F);
+    BasicBlock *Exit = BasicBlock::Create(C, "", F);
+    HandleDecryptionBlock(B, Exit, eagerkeys);
+    ReturnInst::Create(C, Exit);
+    appendToGlobalCtors(M, F, 0);
+  }
+
+  /* PackGlobals
+   *
+   * Replace the encrypted strings, decrypt spaces and keys of the module by
+   * the fields of one struct global each, in the order of the module. Their
+   * offsets are folded into the constant GEPs of their users. Every field
+   * keeps the alignment its global had, or would have got, on its own, with
+   * explicit padding in front of it. Thread local strings, strings of other
+   * address spaces and strings with a section or comdat are left alone.
+   */
+  void PackGlobals(Module &M) {
+    DenseSet<GlobalVariable *> EncryptedGVs, DecryptSpaceGVs, KeyGVs;
+    for (std::map<GlobalVariable *,
+                  std::pair<Constant *, GlobalVariable *>>::iterator iter =
+             mgv2keys.begin();
+         iter != mgv2keys.end(); ++iter) {
+      DecryptSpaceGVs.insert(iter->first);
+      if (iter->second.second != iter->first)
+        EncryptedGVs.insert(iter->second.second);
+    }
+    for (std::map<GlobalVariable *, GlobalVariable *>::iterator iter =
+             decryptionkeys.begin();
+         iter != decryptionkeys.end(); ++iter)
+      KeyGVs.insert(iter->second);
+    std::vector<GlobalVariable *> Encrypted, DecryptSpaces, Keys;
+    for (GlobalVariable &GV : M.globals()) {
+      if (GV.isThreadLocal() || GV.getType()->getAddressSpace() != 0 ||
+          GV.hasSection() || GV.hasComdat())
+        continue;
+      if (EncryptedGVs.count(&GV))
+        Encrypted.emplace_back(&GV);
+      else if (DecryptSpaceGVs.count(&GV)) {
+        // Keep zero initialized decrypt spaces out of the data section
+        if (!GV.getInitializer()->isNullValue())
+          DecryptSpaces.emplace_back(&GV);
+      } else if (KeyGVs.count(&GV))
+        Keys.emplace_back(&GV);
+    }
+    std::vector<std::pair<
+        GlobalVariable * /*Blob*/,
+        std::vector<std::pair<GlobalVariable *, unsigned /*Field*/>>>>
+        Packs;
+    DenseSet<GlobalVariable *> Packed;
+    const DataLayout &DL = M.getDataLayout();
+    Type *Int8Ty = Type::getInt8Ty(M.getContext());
+    auto Pack = [&](std::vector<GlobalVariable *> &GVs, bool isConstant,
+                    const char *Name) {
+      if (GVs.size() < 2)
+        return;
+      // Spell the layout out in a packed struct, so that every field is at
+      // least as aligned as its users, e.g. an aligned memcpy, may assume
+      std::vector<Type *> Types;
+      std::vector<Constant *> Inits;
+      std::vector<std::pair<GlobalVariable *, unsigned>> Fields;
+      uint64_t Offset = 0;
+      Align MaxAlign(1);
+      for (GlobalVariable *GV : GVs) {
+        Align A =
+            std::max(GV->getAlign().valueOrOne(), DL.getPreferredAlign(GV));
+        MaxAlign = std::max(MaxAlign, A);
+        uint64_t Aligned = alignTo(Offset, A);
+        if (Aligned != Offset) {
+          ArrayType *PadTy = ArrayType::get(Int8Ty, Aligned - Offset);
+          Types.emplace_back(PadTy);
+          Inits.emplace_back(ConstantAggregateZero::get(PadTy));
+        }
+        Fields.emplace_back(GV, Types.size());
+        Types.emplace_back(GV->getValueType());
+        Inits.emplace_back(GV->getInitializer());
+        Offset = Aligned + DL.getTypeAllocSize(GV->getValueType());
+        Packed.insert(GV);
+      }
+      StructType *STy = StructType::get(M.getContext(), Types, true);
+      GlobalVariable *Blob = new GlobalVariable(
+          M, STy, isConstant, GlobalValue::LinkageTypes::PrivateLinkage,
+          ConstantStruct::get(STy, Inits), Name);
+      Blob->setAlignment(MaxAlign);
+      genedgv.insert(Blob);
+      Packs.emplace_back(Blob, Fields);
+    };
+    Pack(Encrypted, false, "EncryptedStrings");
+    Pack(DecryptSpaces, false, "DecryptSpaces");
+    Pack(Keys, true, "EncryptedStringKeys");
+    if (Packs.empty())
+      return;
+    // llvm.compiler.used may only list globals, not fields of them
+    if (GlobalVariable *Used = M.getGlobalVariable("llvm.compiler.used")) {
+      std::vector<GlobalValue *> Kept;
+      if (ConstantArray *CA = dyn_cast<ConstantArray>(Used->getInitializer()))
+        for (Value *Op : CA->operands()) {
+          GlobalValue *GV = cast<GlobalValue>(Op->stripPointerCasts());
+          if (!Packed.count(dyn_cast<GlobalVariable>(GV)))
+            Kept.emplace_back(GV);
+        }
+      Used->eraseFromParent();
+      appendToCompilerUsed(M, Kept);
+    }
+    Type *Int32Ty = Type::getInt32Ty(M.getContext());
+    for (std::pair<GlobalVariable *,
+                   std::vector<std::pair<GlobalVariable *, unsigned>>> &P :
+         Packs) {
+      appendToCompilerUsed(M, {P.first});
+      for (std::pair<GlobalVariable *, unsigned> &Field : P.second) {
+        GlobalVariable *GV = Field.first;
+        GV->replaceAllUsesWith(ConstantExpr::getInBoundsGetElementPtr(
+            P.first->getValueType(), P.first,
+            ArrayRef<Constant *>{ConstantInt::get(Int32Ty, 0),
+                                 ConstantInt::get(Int32Ty, Field.second)}));
+        genedgv.erase(GV);
+        GV->eraseFromParent();
+      }
+    }
+  }
+
   void HandleFunction(Function *Func) {
     FixFunctionConstantExpr(Func);
+    // Globals in the order they were found, each of them once
     std::vector<GlobalVariable *> Globals;
+    DenseSet<GlobalVariable *> SeenGlobals;
     std::set<User *> Users;
     for (Instruction &I : instructions(Func))
       for (Value *Op : I.operands())
@@ -110,7 +411,8 @@ struct StringEncryption : public ModulePass {
           if (User *U = dyn_cast<User>(Op))
             Users.insert(U);
           Users.insert(&I);
-          Globals.emplace_back(G);
+          if (SeenGlobals.insert(G).second)
+            Globals.emplace_back(G);
         }
     std::set<GlobalVariable *> rawStrings;
     std::set<GlobalVariable *> objCStrings;
@@ -120,90 +422,59 @@ struct StringEncryption : public ModulePass {
                        GlobalVariable * /*decrypt space*/>>
         old2new;
 
-    auto end = Globals.end();
-    for (auto it = Globals.begin(); it != end; ++it) {
-      end = std::remove(it + 1, end, *it);
-    }
-    Globals.erase(end, Globals.end());
-
     Module *M = Func->getParent();
 
-    std::vector<GlobalVariable *> transedGlobals, unhandleablegvs;
-
-    do {
-      for (GlobalVariable *GV : Globals) {
-        if (std::find(transedGlobals.begin(), transedGlobals.end(), GV) ==
-            transedGlobals.end()) {
-          bool breakThisFor = false;
-          if (handleableGV(GV)) {
-            if (GlobalVariable *CastedGV = dyn_cast<GlobalVariable>(
-                    GV->getInitializer()->stripPointerCasts())) {
-              if (std::find(Globals.begin(), Globals.end(), CastedGV) ==
-                  Globals.end()) {
-                Globals.emplace_back(CastedGV);
-                ConstantExpr *CE = dyn_cast<ConstantExpr>(GV->getInitializer());
-                Users.insert(CE ? CE : GV->getInitializer());
-                breakThisFor = true;
-              }
-            }
-            if (GV->getInitializer()->getType() ==
-                StructType::getTypeByName(M->getContext(),
-                                          "struct.__NSConstantString_tag")) {
-              objCStrings.insert(GV);
-              rawStrings.insert(cast<GlobalVariable>(
-                  cast<ConstantStruct>(GV->getInitializer())
-                      ->getOperand(2)
-                      ->stripPointerCasts()));
-            } else if (isa<ConstantDataSequential>(GV->getInitializer())) {
-              rawStrings.insert(GV);
-            } else if (ConstantStruct *CS =
-                           dyn_cast<ConstantStruct>(GV->getInitializer())) {
-              for (unsigned i = 0; i < CS->getNumOperands(); i++) {
-                Constant *Op = CS->getOperand(i);
-                if (GlobalVariable *OpGV =
-                        dyn_cast<GlobalVariable>(Op->stripPointerCasts())) {
-                  if (!handleableGV(OpGV)) {
-                    unhandleablegvs.emplace_back(OpGV);
-                    continue;
-                  }
-                  Users.insert(opaquepointers ? CS : Op);
-                  if (std::find(Globals.begin(), Globals.end(), OpGV) ==
-                      Globals.end()) {
-                    Globals.emplace_back(OpGV);
-                    breakThisFor = true;
-                  }
-                }
-              }
-            } else if (ConstantArray *CA =
-                           dyn_cast<ConstantArray>(GV->getInitializer())) {
-              for (unsigned j = 0; j < CA->getNumOperands(); j++) {
-                Constant *Op = CA->getOperand(j);
-                if (GlobalVariable *OpGV =
-                        dyn_cast<GlobalVariable>(Op->stripPointerCasts())) {
-                  if (!handleableGV(OpGV)) {
-                    unhandleablegvs.emplace_back(OpGV);
-                    continue;
-                  }
-                  Users.insert(opaquepointers ? CA : Op);
-                  if (std::find(Globals.begin(), Globals.end(), OpGV) ==
-                      Globals.end()) {
-                    Globals.emplace_back(OpGV);
-                    breakThisFor = true;
-                  }
-                }
-              }
+    std::vector<GlobalVariable *> unhandleablegvs;
+    std::unique_ptr<DominatorTree> DT;
+    if (StackThreshold)
+      DT = std::make_unique<DominatorTree>(*Func);
+
+    // Globals referenced by the initializers of handleable ones are appended
+    // to the worklist and visited after it
+    for (size_t GI = 0; GI < Globals.size(); GI++) {
+      GlobalVariable *GV = Globals[GI];
+      if (!handleableGV(GV)) {
+        unhandleablegvs.emplace_back(GV);
+        continue;
+      }
+      if (GlobalVariable *CastedGV = dyn_cast<GlobalVariable>(
+              GV->getInitializer()->stripPointerCasts())) {
+        if (SeenGlobals.insert(CastedGV).second) {
+          Globals.emplace_back(CastedGV);
+          ConstantExpr *CE = dyn_cast<ConstantExpr>(GV->getInitializer());
+          Users.insert(CE ? CE : GV->getInitializer());
+        }
+      }
+      if (GV->getInitializer()->getType() ==
+          StructType::getTypeByName(M->getContext(),
+                                    "struct.__NSConstantString_tag")) {
+        objCStrings.insert(GV);
+        rawStrings.insert(
+            cast<GlobalVariable>(cast<ConstantStruct>(GV->getInitializer())
+                                     ->getOperand(2)
+                                     ->stripPointerCasts()));
+      } else if (isa<ConstantDataSequential>(GV->getInitializer())) {
+        rawStrings.insert(GV);
+      } else if (isa<ConstantStruct>(GV->getInitializer()) ||
+                 isa<ConstantArray>(GV->getInitializer())) {
+        Constant *Aggregate = GV->getInitializer();
+        for (unsigned i = 0; i < Aggregate->getNumOperands(); i++) {
+          Constant *Op = cast<Constant>(Aggregate->getOperand(i));
+          if (GlobalVariable *OpGV =
+                  dyn_cast<GlobalVariable>(Op->stripPointerCasts())) {
+            if (!handleableGV(OpGV)) {
+              unhandleablegvs.emplace_back(OpGV);
+              continue;
             }
-          } else {
-            unhandleablegvs.emplace_back(GV);
+            Users.insert(opaquepointers ? Aggregate : Op);
+            if (SeenGlobals.insert(OpGV).second)
+              Globals.emplace_back(OpGV);
           }
-          transedGlobals.emplace_back(GV);
-          if (breakThisFor)
-            break;
         }
-      } // foreach loop
-    } while (transedGlobals.size() != Globals.size());
+      }
+    }
     for (GlobalVariable *ugv : unhandleablegvs)
-      if (std::find(genedgv.begin(), genedgv.end(), ugv) != genedgv.end()) {
+      if (genedgv.count(ugv)) {
         std::pair<Constant *, GlobalVariable *> mgv2keysval = mgv2keys[ugv];
         if (ugv->getInitializer()->getType() ==
             StructType::getTypeByName(M->getContext(),
@@ -229,112 +500,146 @@ struct StringEncryption : public ModulePass {
       Type *ElementTy = CDS->getElementType();
       if (!ElementTy->isIntegerTy())
         continue;
-      IntegerType *intType = cast<IntegerType>(ElementTy);
-      Constant *KeyConst, *EncryptedConst, *DummyConst = nullptr;
-      unencryptedindex[GV] = {};
-      if (intType == Type::getInt8Ty(M->getContext())) {
-        std::vector<uint8_t> keys, encry, dummy;
-        for (unsigned i = 0; i < CDS->getNumElements(); i++) {
-          if (cryptoutils->get_range(100) >= ElementEncryptProb) {
-            unencryptedindex[GV].emplace_back(i);
-            keys.emplace_back(1);
-            dummy.emplace_back(CDS->getElementAsInteger(i));
-            continue;
-          }
-          const uint8_t K = cryptoutils->get_uint8_t();
-          const uint64_t V = CDS->getElementAsInteger(i);
-          keys.emplace_back(K);
-          encry.emplace_back(K ^ V);
-          dummy.emplace_back(cryptoutils->get_uint8_t());
-        }
-        KeyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint8_t>(keys));
-        EncryptedConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint8_t>(encry));
-        DummyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint8_t>(dummy));
-
-      } else if (intType == Type::getInt16Ty(M->getContext())) {
-        std::vector<uint16_t> keys, encry, dummy;
-        for (unsigned i = 0; i < CDS->getNumElements(); i++) {
-          if (cryptoutils->get_range(100) >= ElementEncryptProb) {
-            unencryptedindex[GV].emplace_back(i);
-            keys.emplace_back(1);
-            dummy.emplace_back(CDS->getElementAsInteger(i));
-            continue;
-          }
-          const uint16_t K = cryptoutils->get_uint16_t();
-          const uint64_t V = CDS->getElementAsInteger(i);
-          keys.emplace_back(K);
-          encry.emplace_back(K ^ V);
-          dummy.emplace_back(cryptoutils->get_uint16_t());
-        }
-        KeyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint16_t>(keys));
-        EncryptedConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint16_t>(encry));
-        DummyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint16_t>(dummy));
-      } else if (intType == Type::getInt32Ty(M->getContext())) {
-        std::vector<uint32_t> keys, encry, dummy;
-        for (unsigned i = 0; i < CDS->getNumElements(); i++) {
-          if (cryptoutils->get_range(100) >= ElementEncryptProb) {
-            unencryptedindex[GV].emplace_back(i);
-            keys.emplace_back(1);
-            dummy.emplace_back(CDS->getElementAsInteger(i));
-            continue;
-          }
-          const uint32_t K = cryptoutils->get_uint32_t();
-          const uint64_t V = CDS->getElementAsInteger(i);
-          keys.emplace_back(K);
-          encry.emplace_back(K ^ V);
-          dummy.emplace_back(cryptoutils->get_uint32_t());
-        }
-        KeyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint32_t>(keys));
-        EncryptedConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint32_t>(encry));
-        DummyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint32_t>(dummy));
-      } else if (intType == Type::getInt64Ty(M->getContext())) {
-        std::vector<uint64_t> keys, encry, dummy;
-        for (unsigned i = 0; i < CDS->getNumElements(); i++) {
-          if (cryptoutils->get_range(100) >= ElementEncryptProb) {
-            unencryptedindex[GV].emplace_back(i);
-            keys.emplace_back(1);
-            dummy.emplace_back(CDS->getElementAsInteger(i));
-            continue;
-          }
-          const uint64_t K = cryptoutils->get_uint64_t();
-          const uint64_t V = CDS->getElementAsInteger(i);
-          keys.emplace_back(K);
-          encry.emplace_back(K ^ V);
-          dummy.emplace_back(cryptoutils->get_uint64_t());
-        }
-        KeyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint64_t>(keys));
-        EncryptedConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint64_t>(encry));
-        DummyConst =
-            ConstantDataArray::get(M->getContext(), ArrayRef<uint64_t>(dummy));
-      } else {
-        llvm_unreachable("Unsupported CDS Type");
+      if (StackThreshold && HandleStackString(Func, GV, *DT))
+        continue;
+      if (GlobalVariable *DecryptSpaceGV =
+              SharedState ? findSharedString(GV) : nullptr) {
+        // The decrypt space has to satisfy the users of both literals
+        if (GV->getAlign() && (!DecryptSpaceGV->getAlign() ||
+                               *DecryptSpaceGV->getAlign() < *GV->getAlign()))
+          DecryptSpaceGV->setAlignment(GV->getAlign());
+        old2new[GV] =
+            std::make_pair(mgv2keys[DecryptSpaceGV].second, DecryptSpaceGV);
+        GV2Keys[DecryptSpaceGV] = mgv2keys[DecryptSpaceGV];
+        continue;
       }
+      Constant *KeyConst, *EncryptedConst, *DummyConst = nullptr;
+      BitVector Unencrypted;
+      // The constructor decrypts every string with the loop
+      bool Loop =
+          (EagerDecryption ||
+           (LoopThreshold && CDS->getNumElements() >= LoopThreshold)) &&
+          GV->getType()->getAddressSpace() == 0;
+      uint64_t Size = M->getDataLayout().getTypeAllocSize(CDS->getType());
+      bool Chunked = ChunkThreshold && Size >= ChunkThreshold &&
+                     GV->getType()->getAddressSpace() == 0 &&
+                     !GV->isThreadLocal();
+      std::vector<uint8_t> Compressed;
+      if (Chunked) {
+        // Every chunk of the keystream of the seed can be derived on its own
+        uint32_t Seed = cryptoutils->get_uint32_t();
+        KeyConst = ConstantInt::get(Type::getInt32Ty(M->getContext()), Seed);
+        EncryptWithKeystream(
+            CDS,
+            [&](uint64_t j) {
+              return hashKeystream(Seed + (uint32_t)j * 0x9E3779B9);
+            },
+            M->getDataLayout().isLittleEndian(), EncryptedConst, DummyConst);
+        DummyConst = ConstantAggregateZero::get(CDS->getType());
+        Loop = false;
+      } else if (CompressThreshold && GV->getType()->getAddressSpace() == 0 &&
+          CDS->getNumElements() * CDS->getElementByteSize() >=
+              CompressThreshold &&
+          CompressString(CDS, M->getDataLayout().isLittleEndian(),
+                         Compressed)) {
+        // The seed takes the place of the keys, compressed strings are told
+        // apart from the keystream ones by their decrypt space
+        uint32_t Seed = cryptoutils->get_uint32_t();
+        KeyConst = ConstantInt::get(Type::getInt32Ty(M->getContext()), Seed);
+        for (uint64_t i = 0; i < Compressed.size(); i++)
+          Compressed[i] ^=
+              hashKeystream(Seed + (uint32_t)(i / 4) * 0x9E3779B9) >>
+              (8 * (i % 4));
+        EncryptedConst = ConstantDataArray::get(M->getContext(), Compressed);
+        DummyConst = ConstantAggregateZero::get(CDS->getType());
+        Loop = false;
+      } else if (ChaChaKeys && GV->getType()->getAddressSpace() == 0) {
+        // The nonce takes the place of the keys, as a vector to tell it
+        // apart from them
+        uint32_t Nonce[3] = {0, 0, 0};
+        while (!(Nonce[0] | Nonce[1] | Nonce[2]))
+          for (uint32_t &N : Nonce)
+            N = cryptoutils->get_uint32_t();
+        KeyConst = ConstantDataVector::get(M->getContext(), Nonce);
+        getChaChaKey(M);
+        uint32_t Block[16];
+        uint64_t CurrentBlock = ~0ULL;
+        EncryptWithKeystream(
+            CDS,
+            [&](uint64_t j) {
+              if (j / 16 != CurrentBlock) {
+                CurrentBlock = j / 16;
+                chachaBlock(chachakeywords, CurrentBlock, Nonce, Block);
+              }
+              return Block[j % 16];
+            },
+            M->getDataLayout().isLittleEndian(), EncryptedConst, DummyConst);
+        Loop = false;
+      } else if (KeystreamKeys && GV->getType()->getAddressSpace() == 0) {
+        // The seed takes the place of the keys
+        uint32_t Seed = cryptoutils->get_uint32_t();
+        KeyConst = ConstantInt::get(Type::getInt32Ty(M->getContext()), Seed);
+        EncryptWithKeystream(
+            CDS,
+            [&](uint64_t j) {
+              return hashKeystream(Seed + (uint32_t)j * 0x9E3779B9);
+            },
+            M->getDataLayout().isLittleEndian(), EncryptedConst, DummyConst);
+        Loop = false;
+      } else
+        EncryptElements(CDS, Loop || InPlace, Unencrypted, KeyConst,
+                        EncryptedConst, DummyConst);
       // Prepare new rawGV
-      GlobalVariable *EncryptedRawGV = new GlobalVariable(
-          *M, EncryptedConst->getType(), false, GV->getLinkage(),
-          EncryptedConst, "EncryptedString", nullptr, GV->getThreadLocalMode(),
-          GV->getType()->getAddressSpace());
-      genedgv.emplace_back(EncryptedRawGV);
+      GlobalVariable *EncryptedRawGV = nullptr;
+      bool DecryptInPlace = InPlace && !Chunked && Compressed.empty();
+      if (!DecryptInPlace) {
+        EncryptedRawGV = new GlobalVariable(
+            *M, EncryptedConst->getType(), false, GV->getLinkage(),
+            EncryptedConst, "EncryptedString", nullptr,
+            GV->getThreadLocalMode(), GV->getType()->getAddressSpace());
+        genedgv.insert(EncryptedRawGV);
+      }
       GlobalVariable *DecryptSpaceGV = new GlobalVariable(
-          *M, DummyConst->getType(), false, GV->getLinkage(), DummyConst,
-          "DecryptSpace", nullptr, GV->getThreadLocalMode(),
-          GV->getType()->getAddressSpace());
-      genedgv.emplace_back(DecryptSpaceGV);
+          *M, DummyConst->getType(), false, GV->getLinkage(),
+          DecryptInPlace ? EncryptedConst : DummyConst, "DecryptSpace", nullptr,
+          GV->getThreadLocalMode(), GV->getType()->getAddressSpace());
+      // Users of the string, e.g. an aligned memcpy, may rely on its alignment
+      DecryptSpaceGV->setAlignment(GV->getAlign());
+      genedgv.insert(DecryptSpaceGV);
+      // Decrypted in place, the decrypt space is its own encrypted copy
+      if (DecryptInPlace)
+        EncryptedRawGV = DecryptSpaceGV;
+      if (!Compressed.empty())
+        compressedstrings.insert(DecryptSpaceGV);
+      if (Chunked) {
+        Type *Int32Ty = Type::getInt32Ty(M->getContext());
+        uint64_t Chunks = (Size + ChunkSize - 1) / ChunkSize;
+        ArrayType *StatusTy = ArrayType::get(Int32Ty, Chunks);
+        chunkstatus[DecryptSpaceGV] = new GlobalVariable(
+            *M, StatusTy, false, GlobalValue::LinkageTypes::PrivateLinkage,
+            ConstantAggregateZero::get(StatusTy),
+            "StringEncryptionChunkStatus");
+      }
       old2new[GV] = std::make_pair(EncryptedRawGV, DecryptSpaceGV);
       GV2Keys[DecryptSpaceGV] = std::make_pair(KeyConst, EncryptedRawGV);
       mgv2keys[DecryptSpaceGV] = GV2Keys[DecryptSpaceGV];
-      unencryptedindex[KeyConst] = unencryptedindex[GV];
+      if (Unencrypted.any())
+        unencryptedindex[DecryptSpaceGV] = std::move(Unencrypted);
+      if (Loop) {
+        GlobalVariable *KeyGV = new GlobalVariable(
+            *M, KeyConst->getType(), true, GV->getLinkage(), KeyConst,
+            "EncryptedStringKey");
+        genedgv.insert(KeyGV);
+        decryptionkeys[DecryptSpaceGV] = KeyGV;
+      }
+      if (SharedState) {
+        sharedstrings[GV] = DecryptSpaceGV;
+        if (GV->isConstant() && GV->hasGlobalUnnamedAddr() &&
+            !GV->isThreadLocal())
+          sharedliterals[std::make_pair(GV->getInitializer(),
+                                        GV->getType()->getAddressSpace())] =
+              DecryptSpaceGV;
+      }
     }
     // Now prepare ObjC new GV
     for (GlobalVariable *GV : objCStrings) {
@@ -344,25 +649,34 @@ struct StringEncryption : public ModulePass {
       if (old2new.find(oldrawString) ==
           old2new.end()) // Filter out zero initializers
         continue;
-      GlobalVariable *EncryptedOCGV = ObjectiveCString(
-          GV, "EncryptedStringObjC", old2new[oldrawString].first, CS);
-      genedgv.emplace_back(EncryptedOCGV);
+      GlobalVariable *EncryptedOCGV = nullptr;
+      if (!InPlace) {
+        EncryptedOCGV = ObjectiveCString(GV, "EncryptedStringObjC",
+                                         old2new[oldrawString].first, CS);
+        genedgv.insert(EncryptedOCGV);
+      }
       GlobalVariable *DecryptSpaceOCGV = ObjectiveCString(
           GV, "DecryptSpaceObjC", old2new[oldrawString].second, CS);
-      genedgv.emplace_back(DecryptSpaceOCGV);
+      genedgv.insert(DecryptSpaceOCGV);
+      if (InPlace)
+        EncryptedOCGV = DecryptSpaceOCGV;
       old2new[GV] = std::make_pair(EncryptedOCGV, DecryptSpaceOCGV);
     } // End prepare ObjC new GV
     if (GV2Keys.empty())
       return;
     // Replace Uses
-    for (User *U : Users) {
-      for (std::map<GlobalVariable *,
-                    std::pair<GlobalVariable *, GlobalVariable *>>::iterator
-               iter = old2new.begin();
-           iter != old2new.end(); ++iter) {
+    // Only the users of each old GV can refer to it
+    for (std::map<GlobalVariable *,
+                  std::pair<GlobalVariable *, GlobalVariable *>>::iterator
+             iter = old2new.begin();
+         iter != old2new.end(); ++iter) {
+      SmallVector<User *, 8> OldUsers;
+      for (User *U : iter->first->users())
+        if (Users.count(U))
+          OldUsers.emplace_back(U);
+      for (User *U : OldUsers)
         U->replaceUsesOfWith(iter->first, iter->second.second);
-        iter->first->removeDeadConstantUsers();
-      }
+      iter->first->removeDeadConstantUsers();
     } // End Replace Uses
       // CleanUp Old ObjC GVs
     for (GlobalVariable *GV : objCStrings)
@@ -379,50 +693,1567 @@ struct StringEncryption : public ModulePass {
       GlobalVariable *toDelete = iter->first;
       toDelete->removeDeadConstantUsers();
       if (toDelete->getNumUses() == 0) {
+        sharedstrings.erase(toDelete);
         toDelete->dropAllReferences();
         toDelete->eraseFromParent();
       }
     }
-    GlobalVariable *StatusGV = encstatus[Func];
-    /*
-       - Split Original EntryPoint BB into A and C.
-       - Create new BB as Decryption BB between A and C. Adjust the terminators
-         into: A (Alloca a new array containing all)
-               |
-               B(If not decrypted)
-               |
-               C
-     */
-    BasicBlock *A = &(Func->getEntryBlock());
-    BasicBlock *C = A->splitBasicBlock(A->getFirstNonPHIOrDbgOrLifetime());
-    C->setName("PrecedingBlock");
+    if (!chunkstatus.empty()) {
+      HandleChunkedDecryption(Func, GV2Keys);
+      if (GV2Keys.empty())
+        return;
+    }
+    if (EagerDecryption) {
+      // Every thread has its own copy of thread local strings to decrypt
+      for (std::map<GlobalVariable *,
+                    std::pair<Constant *, GlobalVariable *>>::iterator iter =
+               GV2Keys.begin();
+           iter != GV2Keys.end();)
+        if (!iter->first->isThreadLocal()) {
+          eagerkeys.insert(*iter);
+          iter = GV2Keys.erase(iter);
+        } else
+          ++iter;
+      if (GV2Keys.empty())
+        return;
+    } else if (LazyDecryption) {
+      HandleLazyDecryption(Func, GV2Keys);
+      if (GV2Keys.empty())
+        return;
+    }
+    // Shared strings keep their own status instead of the function's, as do
+    // strings decrypted in place which must not be decrypted twice and the
+    // thread local strings left by -strcry_eager
+    bool StringStatus = SharedState || InPlace || EagerDecryption;
+    Instruction *EntryPoint =
+        Func->getEntryBlock().getFirstNonPHIOrDbgOrLifetime();
+    if (TrampolineDecryption) {
+      std::vector<GlobalVariable *> Statuses;
+      if (StringStatus)
+        for (std::map<GlobalVariable *,
+                      std::pair<Constant *, GlobalVariable *>>::iterator iter =
+                 GV2Keys.begin();
+             iter != GV2Keys.end(); ++iter)
+          Statuses.emplace_back(getStringStatus(iter->first));
+      else
+        Statuses.emplace_back(encstatus[Func]);
+      EntryPoint = CreateTrampoline(Func, GV2Keys, Statuses);
+    }
+    if (StringStatus) {
+      for (std::map<GlobalVariable *,
+                    std::pair<Constant *, GlobalVariable *>>::iterator iter =
+               GV2Keys.begin();
+           iter != GV2Keys.end(); ++iter) {
+        std::map<GlobalVariable *, std::pair<Constant *, GlobalVariable *>>
+            Keys = {*iter};
+        InsertDecryptionGuard(EntryPoint, getStringStatus(iter->first), Keys);
+      }
+      return;
+    }
+    InsertDecryptionGuard(EntryPoint, encstatus[Func], GV2Keys);
+  } // End of HandleFunction
+
+  /* CreateTrampoline
+   *
+   * Move the body of Func into a private function and let Func jump to what
+   * a slot points to, at first a trampoline that decrypts the strings, points
+   * the slot at the body and jumps there:
+   *     Func -> Slot -> Trampoline (Decrypt, Publish) -> Body
+   *     Func -> Slot -> Body
+   * Func loads the slot without ordering, so the body must not be published
+   * before every thread is sure to see the decrypted strings. x86 doesn't
+   * reorder loads, elsewhere the trampoline first makes every thread of the
+   * process pass a memory barrier with membarrier(2). If that fails the slot
+   * is pointed at a guard that checks the Statuses of the strings on every
+   * call instead, like the entry of Func would without a trampoline, and
+   * only goes back to the trampoline while they are not decrypted:
+   *     Func -> Slot -> Guard (Check) -> Body
+   * Only x86 forwards with musttail, the other backends
+   * can't tail call every signature, e.g. with stack arguments or on Thumb1,
+   * and fail hard on a musttail call they can't lower, so they get a plain
+   * tail call and functions with ABI attributes a copy can't forward stay as
+   * they are. Returns where to decrypt, the entry of Func if it can't be
+   * moved.
+   */
+  Instruction *CreateTrampoline(
+      Function *Func,
+      std::map<GlobalVariable *, std::pair<Constant *, GlobalVariable *>>
+          &GV2Keys,
+      std::vector<GlobalVariable *> &Statuses) {
+    Instruction *EntryPoint =
+        Func->getEntryBlock().getFirstNonPHIOrDbgOrLifetime();
+    Module *M = Func->getParent();
+    Triple T(M->getTargetTriple());
+    uint64_t SysMembarrier = getMembarrierSyscall(T);
+    bool MustTail = T.isX86();
+    // Every thread decrypts its own copy of thread local strings
+    if ((!MustTail && !SysMembarrier) || Func->isVarArg() ||
+        Func->hasFnAttribute(Attribute::Naked) ||
+        Func->isPresplitCoroutine() ||
+        std::any_of(Func->begin(), Func->end(),
+                    [](BasicBlock &BB) { return BB.hasAddressTaken(); }) ||
+        std::any_of(Func->arg_begin(), Func->arg_end(),
+                    [MustTail](Argument &Arg) {
+                      // byval arguments get corrupted when x86 forwards
+                      // them with musttail
+                      return Arg.hasByValAttr() ||
+                             (!MustTail && (Arg.hasStructRetAttr() ||
+                                            Arg.hasInAllocaAttr() ||
+                                            Arg.hasPreallocatedAttr() ||
+                                            Arg.hasSwiftErrorAttr()));
+                    }) ||
+        std::any_of(GV2Keys.begin(), GV2Keys.end(),
+                    [](std::pair<GlobalVariable *const,
+                                 std::pair<Constant *, GlobalVariable *>> &KV) {
+                      return KV.first->isThreadLocal();
+                    }))
+      return EntryPoint;
+    LLVMContext &C = M->getContext();
+    FunctionType *FTy = Func->getFunctionType();
+    Function *Body = Function::Create(
+        FTy, GlobalValue::LinkageTypes::PrivateLinkage,
+        Func->getName() + ".body", M);
+    Body->copyAttributesFrom(Func);
+    Body->setLinkage(GlobalValue::LinkageTypes::PrivateLinkage);
+    Body->setVisibility(GlobalValue::DefaultVisibility);
+    Body->setDLLStorageClass(GlobalValue::DefaultStorageClass);
+    Body->setPrefixData(nullptr);
+    Body->setPrologueData(nullptr);
+    Body->getBasicBlockList().splice(Body->end(), Func->getBasicBlockList());
+    for (unsigned i = 0; i < FTy->getNumParams(); i++) {
+      Func->getArg(i)->replaceAllUsesWith(Body->getArg(i));
+      Body->getArg(i)->takeName(Func->getArg(i));
+    }
+    Body->setSubprogram(Func->getSubprogram());
+    Func->setSubprogram(nullptr);
+    // The body is obfuscated like Func would have been, what is left of Func
+    // must stay a single jump
+    std::string Annotation = readAnnotate(Func);
+    if (!Annotation.empty())
+      writeAnnotate(Body, Annotation);
+    writeAnnotate(Func, "nosplit nobcf nofla nosub noconstenc noindibr nofw");
+    Function *Trampoline =
+        Function::Create(FTy, GlobalValue::LinkageTypes::PrivateLinkage,
+                         "HikariStringDecryptionTrampoline", M);
+    Trampoline->copyAttributesFrom(Body);
+    writeAnnotate(Trampoline, "nostrenc nosplit nobcf nofla nosub noconstenc "
+                              "noindibr nofw");
+    GlobalVariable *Slot = new GlobalVariable(
+        *M, Func->getType(), false, GlobalValue::LinkageTypes::PrivateLinkage,
+        Trampoline, "StringEncryptionTrampolineSlot");
+    // Forward all arguments with the ABI of Func
+    auto Jump = [&](BasicBlock *BB, Value *Callee) {
+      IRBuilder<> IRB(BB);
+      std::vector<Value *> Args;
+      std::vector<AttributeSet> ArgAttrs;
+      for (Argument &Arg : BB->getParent()->args()) {
+        Args.emplace_back(&Arg);
+        ArgAttrs.emplace_back(Func->getAttributes().getParamAttrs(
+            Arg.getArgNo()));
+      }
+      CallInst *CI = IRB.CreateCall(FTy, Callee, Args);
+      CI->setCallingConv(Func->getCallingConv());
+      CI->setAttributes(AttributeList::get(
+          C, AttributeSet(), Func->getAttributes().getRetAttrs(), ArgAttrs));
+      CI->setTailCallKind(MustTail ? CallInst::TCK_MustTail
+                                   : CallInst::TCK_Tail);
+      if (FTy->getReturnType()->isVoidTy())
+        IRB.CreateRetVoid();
+      else
+        IRB.CreateRet(CI);
+    };
+    BasicBlock *Stub = BasicBlock::Create(C, "", Func);
+    IRBuilder<> IRB(Stub);
+    LoadInst *Target = IRB.CreateLoad(Func->getType(), Slot);
+    Target->setAtomic(AtomicOrdering::Monotonic);
+    Target->setAlignment(M->getDataLayout().getABITypeAlign(Func->getType()));
+    Jump(Stub, Target);
+    BasicBlock *Entry = BasicBlock::Create(C, "", Trampoline);
+    BasicBlock *Publish = BasicBlock::Create(C, "", Trampoline);
+    BasicBlock *Store = BasicBlock::Create(C, "", Trampoline);
+    BasicBlock *Call = BasicBlock::Create(C, "", Trampoline);
+    BranchInst::Create(Publish, Entry);
+    IRB.SetInsertPoint(Publish);
+    if (!SysMembarrier) {
+      IRB.CreateBr(Store);
+      IRB.SetInsertPoint(Store);
+      IRB.CreateAlignedStore(Body, Slot, Target->getAlign())
+          ->setAtomic(AtomicOrdering::Release);
+      IRB.CreateBr(Call);
+      Jump(Call, Body);
+      return Entry->getTerminator();
+    }
+    Function *Guard =
+        Function::Create(FTy, GlobalValue::LinkageTypes::PrivateLinkage,
+                         "HikariStringDecryptionGuard", M);
+    Guard->copyAttributesFrom(Body);
+    writeAnnotate(Guard, "nostrenc nosplit nobcf nofla nosub noconstenc "
+                         "noindibr nofw");
+    BasicBlock *GuardEntry = BasicBlock::Create(C, "", Guard);
+    BasicBlock *GuardBody = BasicBlock::Create(C, "", Guard);
+    BasicBlock *GuardTrampoline = BasicBlock::Create(C, "", Guard);
+    IRB.SetInsertPoint(GuardEntry);
+    Type *Int32Ty = Type::getInt32Ty(C);
+    Value *Decrypted = nullptr;
+    for (GlobalVariable *StatusGV : Statuses) {
+      LoadInst *LI = IRB.CreateLoad(Int32Ty, StatusGV);
+      LI->setAtomic(AtomicOrdering::Acquire);
+      LI->setAlignment(Align(4));
+      Value *Cmp = IRB.CreateICmpEQ(LI, ConstantInt::get(Int32Ty, 2));
+      Decrypted = Decrypted ? IRB.CreateAnd(Decrypted, Cmp) : Cmp;
+    }
+    IRB.CreateCondBr(Decrypted, GuardBody, GuardTrampoline);
+    Jump(GuardBody, Body);
+    Jump(GuardTrampoline, Trampoline);
+    IRB.SetInsertPoint(Publish);
+    BasicBlock *Fallback = BasicBlock::Create(C, "", Trampoline, Call);
+    IRB.CreateCondBr(IRB.CreateCall(getMembarrierRoutine(M, SysMembarrier)),
+                     Store, Fallback);
+    IRB.SetInsertPoint(Store);
+    IRB.CreateAlignedStore(Body, Slot, Target->getAlign())
+        ->setAtomic(AtomicOrdering::Release);
+    IRB.CreateBr(Call);
+    IRB.SetInsertPoint(Fallback);
+    IRB.CreateAlignedStore(Guard, Slot, Target->getAlign())
+        ->setAtomic(AtomicOrdering::Release);
+    IRB.CreateBr(Call);
+    Jump(Call, Body);
+    return Entry->getTerminator();
+  }
+
+  /* getMembarrierRoutine
+   *
+   * i1 HikariStringDecryptionMembarrier()
+   * Makes every thread of the process pass a memory barrier with
+   * membarrier(2) and returns true if it did. The process registers for it
+   * on the first call only, and once registering or a barrier failed every
+   * later call returns false without a syscall.
+   */
+  Function *getMembarrierRoutine(Module *M, uint64_t SysMembarrier) {
+    if (membarrierroutine)
+      return membarrierroutine;
+    LLVMContext &C = M->getContext();
+    Type *Int32Ty = Type::getInt32Ty(C);
+    Type *LongTy = M->getDataLayout().getIntPtrType(C);
+    Function *F = createRuntimeFunction(
+        M, FunctionType::get(Type::getInt1Ty(C), false),
+        "HikariStringDecryptionMembarrier");
+    // 0 unregistered, 1 registered, 2 failed
+    GlobalVariable *State = new GlobalVariable(
+        *M, Int32Ty, false, GlobalValue::LinkageTypes::PrivateLinkage,
+        ConstantInt::get(Int32Ty, 0), "StringEncryptionMembarrierState");
+    FunctionCallee Syscall = M->getOrInsertFunction(
+        "syscall", FunctionType::get(LongTy, {LongTy}, true));
+    BasicBlock *Entry = BasicBlock::Create(C, "", F);
+    BasicBlock *Register = BasicBlock::Create(C, "", F);
+    BasicBlock *Barrier = BasicBlock::Create(C, "", F);
+    BasicBlock *Failed = BasicBlock::Create(C, "", F);
+    BasicBlock *Done = BasicBlock::Create(C, "", F);
+    IRBuilder<> IRB(Entry);
+    LoadInst *LI = IRB.CreateLoad(Int32Ty, State);
+    LI->setAtomic(AtomicOrdering::Monotonic);
+    LI->setAlignment(Align(4));
+    SwitchInst *SI = IRB.CreateSwitch(LI, Done, 2);
+    SI->addCase(IRB.getInt32(0), Register);
+    SI->addCase(IRB.getInt32(1), Barrier);
+    // MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, threads racing to register
+    // all succeed
+    IRB.SetInsertPoint(Register);
+    Value *Ret =
+        IRB.CreateCall(Syscall, {ConstantInt::get(LongTy, SysMembarrier),
+                                 ConstantInt::get(LongTy, 16),
+                                 ConstantInt::get(LongTy, 0)});
+    Value *Registered = IRB.CreateICmpEQ(Ret, ConstantInt::get(LongTy, 0));
+    IRB.CreateAlignedStore(ConstantInt::get(Int32Ty, 1), State, Align(4))
+        ->setAtomic(AtomicOrdering::Monotonic);
+    IRB.CreateCondBr(Registered, Barrier, Failed);
+    // MEMBARRIER_CMD_PRIVATE_EXPEDITED
+    IRB.SetInsertPoint(Barrier);
+    Ret = IRB.CreateCall(Syscall, {ConstantInt::get(LongTy, SysMembarrier),
+                                   ConstantInt::get(LongTy, 8),
+                                   ConstantInt::get(LongTy, 0)});
+    Value *Fenced = IRB.CreateICmpEQ(Ret, ConstantInt::get(LongTy, 0));
+    IRB.CreateCondBr(Fenced, Done, Failed);
+    IRB.SetInsertPoint(Failed);
+    IRB.CreateAlignedStore(ConstantInt::get(Int32Ty, 2), State, Align(4))
+        ->setAtomic(AtomicOrdering::Monotonic);
+    IRB.CreateBr(Done);
+    IRB.SetInsertPoint(Done);
+    PHINode *Result = IRB.CreatePHI(Type::getInt1Ty(C), 3);
+    Result->addIncoming(ConstantInt::getFalse(C), Entry);
+    Result->addIncoming(ConstantInt::getTrue(C), Barrier);
+    Result->addIncoming(ConstantInt::getFalse(C), Failed);
+    IRB.CreateRet(Result);
+    membarrierroutine = F;
+    return F;
+  }
+
+  /* EncryptElements
+   *
+   * Elements left plain by -strcry_prob are skipped by the unrolled decryption
+   * and only kept in the decrypt space. With KeepPlain they are kept in the
+   * encrypted string as well, for in-place decryption and for the decryption
+   * loop, which copies them with a zero key.
+   */
+  template <typename T>
+  void EncryptElements(ConstantDataSequential *CDS, bool KeepPlain,
+                       BitVector &Unencrypted,
+                       Constant *&KeyConst, Constant *&EncryptedConst,
+                       Constant *&DummyConst) {
+    std::vector<T> keys, encry, dummy;
+    Unencrypted.resize(CDS->getNumElements());
+    for (unsigned i = 0; i < CDS->getNumElements(); i++) {
+      const T V = CDS->getElementAsInteger(i);
+      if (cryptoutils->get_range(100) >= ElementEncryptProb) {
+        Unencrypted.set(i);
+        keys.emplace_back(KeepPlain ? 0 : 1);
+        if (KeepPlain)
+          encry.emplace_back(V);
+        dummy.emplace_back(V);
+        continue;
+      }
+      const T K = cryptoutils->get<T>();
+      keys.emplace_back(K);
+      encry.emplace_back(K ^ V);
+      dummy.emplace_back(cryptoutils->get<T>());
+    }
+    KeyConst = ConstantDataArray::get(CDS->getContext(), ArrayRef<T>(keys));
+    EncryptedConst =
+        ConstantDataArray::get(CDS->getContext(), ArrayRef<T>(encry));
+    DummyConst = ConstantDataArray::get(CDS->getContext(), ArrayRef<T>(dummy));
+  }
+
+  void EncryptElements(ConstantDataSequential *CDS, bool KeepPlain,
+                       BitVector &Unencrypted, Constant *&KeyConst,
+                       Constant *&EncryptedConst, Constant *&DummyConst) {
+    LLVMContext &C = CDS->getContext();
+    Type *ElementTy = CDS->getElementType();
+    if (ElementTy == Type::getInt8Ty(C))
+      EncryptElements<uint8_t>(CDS, KeepPlain, Unencrypted, KeyConst,
+                               EncryptedConst, DummyConst);
+    else if (ElementTy == Type::getInt16Ty(C))
+      EncryptElements<uint16_t>(CDS, KeepPlain, Unencrypted, KeyConst,
+                                EncryptedConst, DummyConst);
+    else if (ElementTy == Type::getInt32Ty(C))
+      EncryptElements<uint32_t>(CDS, KeepPlain, Unencrypted, KeyConst,
+                                EncryptedConst, DummyConst);
+    else if (ElementTy == Type::getInt64Ty(C))
+      EncryptElements<uint64_t>(CDS, KeepPlain, Unencrypted, KeyConst,
+                                EncryptedConst, DummyConst);
+    else
+      llvm_unreachable("Unsupported CDS Type");
+  }
+
+  /* HandleStackString
+   *
+   * Decrypt GV into a buffer on the stack of Func right before its uses
+   * instead of into a decrypt space, at the nearest block dominating all of
+   * them. Only constant strings whose address is insignificant qualify, if
+   * they are referenced by instructions of Func alone and not captured, so
+   * that nothing can reach the buffer once Func returned. There is no status,
+   * the buffer is decrypted every time. False if GV doesn't qualify.
+   */
+  bool HandleStackString(Function *Func, GlobalVariable *GV,
+                         DominatorTree &DT) {
+    const DataLayout &DL = Func->getParent()->getDataLayout();
+    ConstantDataSequential *CDS =
+        cast<ConstantDataSequential>(GV->getInitializer());
+    if (!GV->isConstant() || !GV->hasGlobalUnnamedAddr() ||
+        GV->isThreadLocal() ||
+        GV->getType()->getAddressSpace() != DL.getAllocaAddrSpace() ||
+        DL.getTypeAllocSize(CDS->getType()) >= StackThreshold)
+      return false;
+    GV->removeDeadConstantUsers();
+    BasicBlock *Dom = nullptr;
+    for (Use &U : GV->uses()) {
+      Instruction *I = dyn_cast<Instruction>(U.getUser());
+      if (!I || I->getFunction() != Func)
+        return false;
+      // Incoming values of PHIs are used at the end of their block
+      BasicBlock *BB = I->getParent();
+      if (PHINode *PN = dyn_cast<PHINode>(I))
+        BB = PN->getIncomingBlock(U);
+      if (!DT.isReachableFromEntry(BB))
+        return false;
+      Dom = Dom ? DT.findNearestCommonDominator(Dom, BB) : BB;
+    }
+    if (!Dom || PointerMayBeCaptured(GV, true, true))
+      return false;
+    Instruction *InsertPt = Dom->getTerminator();
+    for (Instruction &I : *Dom)
+      if (!isa<PHINode>(I) && is_contained(I.operands(), GV)) {
+        InsertPt = &I;
+        break;
+      }
+    Constant *KeyConst, *EncryptedConst, *DummyConst;
+    BitVector Unencrypted;
+    EncryptElements(CDS, true, Unencrypted, KeyConst, EncryptedConst,
+                    DummyConst);
+    GlobalVariable *EncryptedRawGV = new GlobalVariable(
+        *Func->getParent(), EncryptedConst->getType(), false,
+        GV->getLinkage(), EncryptedConst, "EncryptedString");
+    genedgv.insert(EncryptedRawGV);
+    appendToCompilerUsed(*Func->getParent(), {EncryptedRawGV});
+    AllocaInst *AI = new AllocaInst(
+        CDS->getType(), DL.getAllocaAddrSpace(), nullptr,
+        GV->getPointerAlignment(DL), "DecryptSpace",
+        &*Func->getEntryBlock().getFirstInsertionPt());
+    IRBuilder<NoFolder> IRB(InsertPt);
+    ConstantDataArray *CastedCDA = cast<ConstantDataArray>(KeyConst);
+    Value *zero = ConstantInt::get(Type::getInt32Ty(Func->getContext()), 0);
+    // Plain elements are copied as they are
+    for (uint64_t i = 0; i < CDS->getNumElements(); i++) {
+      Value *offset = ConstantInt::get(Type::getInt64Ty(Func->getContext()), i);
+      Value *V = IRB.CreateLoad(CDS->getElementType(),
+                                IRB.CreateGEP(EncryptedRawGV->getValueType(),
+                                              EncryptedRawGV, {zero, offset}),
+                                "EncryptedChar");
+      if (!Unencrypted.test(i))
+        V = IRB.CreateXor(V, CastedCDA->getElementAsConstant(i));
+      IRB.CreateStore(V, IRB.CreateGEP(AI->getAllocatedType(), AI,
+                                       {zero, offset}));
+    }
+    GV->replaceAllUsesWith(AI);
+    GV->eraseFromParent();
+    return true;
+  }
+
+  // lowbias32 by Chris Wellons, the keystream word j of a string is
+  // hashKeystream(Seed + j * 0x9E3779B9)
+  static uint32_t hashKeystream(uint32_t X) {
+    X ^= X >> 16;
+    X *= 0x7feb352d;
+    X ^= X >> 15;
+    X *= 0x846ca68b;
+    X ^= X >> 16;
+    return X;
+  }
+
+  static Value *hashKeystream(IRBuilder<> &IRB, Value *X) {
+    Type *Int32Ty = X->getType();
+    X = IRB.CreateXor(X, IRB.CreateLShr(X, 16));
+    X = IRB.CreateMul(X, ConstantInt::get(Int32Ty, 0x7feb352d));
+    X = IRB.CreateXor(X, IRB.CreateLShr(X, 15));
+    X = IRB.CreateMul(X, ConstantInt::get(Int32Ty, 0x846ca68b));
+    return IRB.CreateXor(X, IRB.CreateLShr(X, 16));
+  }
+
+  // The ChaCha20 block Counter of Key and Nonce as in RFC 8439
+  static void chachaBlock(const uint32_t Key[8], uint32_t Counter,
+                          const uint32_t Nonce[3], uint32_t Out[16]) {
+    uint32_t In[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+                       Key[0],     Key[1],     Key[2],     Key[3],
+                       Key[4],     Key[5],     Key[6],     Key[7],
+                       Counter,    Nonce[0],   Nonce[1],   Nonce[2]};
+    uint32_t X[16];
+    std::copy(In, In + 16, X);
+    auto Rotl = [](uint32_t V, int C) { return (V << C) | (V >> (32 - C)); };
+    for (int Round = 0; Round < 10; Round++)
+      for (const unsigned *QR : ChaChaQuarterRounds) {
+        uint32_t &A = X[QR[0]], &B = X[QR[1]], &C = X[QR[2]], &D = X[QR[3]];
+        A += B;
+        D = Rotl(D ^ A, 16);
+        C += D;
+        B = Rotl(B ^ C, 12);
+        A += B;
+        D = Rotl(D ^ A, 8);
+        C += D;
+        B = Rotl(B ^ C, 7);
+      }
+    for (unsigned i = 0; i < 16; i++)
+      Out[i] = X[i] + In[i];
+  }
+
+  static SmallVector<Value *, 16> chachaBlock(IRBuilder<> &IRB,
+                                              ArrayRef<Value *> Key,
+                                              Value *Counter,
+                                              ArrayRef<Value *> Nonce) {
+    Type *Int32Ty = Counter->getType();
+    // Counter may be a vector of the counters of several blocks, Key and
+    // Nonce are splat to it
+    SmallVector<Value *, 16> In = {ConstantInt::get(Int32Ty, 0x61707865),
+                                   ConstantInt::get(Int32Ty, 0x3320646e),
+                                   ConstantInt::get(Int32Ty, 0x79622d32),
+                                   ConstantInt::get(Int32Ty, 0x6b206574)};
+    In.append(Key.begin(), Key.end());
+    In.emplace_back(Counter);
+    In.append(Nonce.begin(), Nonce.end());
+    SmallVector<Value *, 16> X(In);
+    auto Rotl = [&](Value *V, int C) {
+      return IRB.CreateOr(IRB.CreateShl(V, C), IRB.CreateLShr(V, 32 - C));
+    };
+    for (int Round = 0; Round < 10; Round++)
+      for (const unsigned *QR : ChaChaQuarterRounds) {
+        Value *&A = X[QR[0]], *&B = X[QR[1]], *&C = X[QR[2]], *&D = X[QR[3]];
+        A = IRB.CreateAdd(A, B);
+        D = Rotl(IRB.CreateXor(D, A), 16);
+        C = IRB.CreateAdd(C, D);
+        B = Rotl(IRB.CreateXor(B, C), 12);
+        A = IRB.CreateAdd(A, B);
+        D = Rotl(IRB.CreateXor(D, A), 8);
+        C = IRB.CreateAdd(C, D);
+        B = Rotl(IRB.CreateXor(B, C), 7);
+      }
+    for (unsigned i = 0; i < 16; i++)
+      X[i] = IRB.CreateAdd(X[i], In[i]);
+    return X;
+  }
+
+  // Column and diagonal quarter rounds of a ChaCha double round
+  static constexpr unsigned ChaChaQuarterRounds[8][4] = {
+      {0, 4, 8, 12}, {1, 5, 9, 13}, {2, 6, 10, 14}, {3, 7, 11, 15},
+      {0, 5, 10, 15}, {1, 6, 11, 12}, {2, 7, 8, 13}, {3, 4, 9, 14}};
+
+  GlobalVariable *getChaChaKey(Module *M) {
+    if (chachakey)
+      return chachakey;
+    for (uint32_t &K : chachakeywords)
+      K = cryptoutils->get_uint32_t();
+    Constant *KeyConst =
+        ConstantDataArray::get(M->getContext(), chachakeywords);
+    chachakey = new GlobalVariable(*M, KeyConst->getType(), true,
+                                   GlobalValue::LinkageTypes::PrivateLinkage,
+                                   KeyConst, "StringEncryptionChaChaKey");
+    genedgv.insert(chachakey);
+    return chachakey;
+  }
+
+  /* getChaChaRoutine
+   *
+   * void HikariStringDecryptChaCha(i8 *dst, i8 *enc, i64 len, i32 *key,
+   *                                i32 n0, i32 n1, i32 n2)
+   * XORs len bytes of enc with the ChaCha20 keystream of key and the nonce
+   * n0, n1, n2 into dst. Four blocks of 64 bytes are computed at a time in
+   * the lanes of 128 bit vectors, then the remaining blocks one by one and
+   * the bytes of the last partial block. Keystream words are stored in the
+   * target's byte order. With -strcry_inplace enc is dst and left out.
+   */
+  Function *getChaChaRoutine(Module *M) {
+    if (chacharoutine)
+      return chacharoutine;
+    LLVMContext &C = M->getContext();
+    Type *Int8Ty = Type::getInt8Ty(C);
+    Type *Int32Ty = Type::getInt32Ty(C);
+    Type *Int64Ty = Type::getInt64Ty(C);
+    Type *Int8PtrTy = Type::getInt8PtrTy(C);
+    std::vector<Type *> Params = {Int8PtrTy, Int8PtrTy, Int64Ty,
+                                  Int32Ty->getPointerTo(), Int32Ty,
+                                  Int32Ty, Int32Ty};
+    if (InPlace)
+      Params.erase(Params.begin() + 1);
+    Function *F = createRuntimeFunction(
+        M, FunctionType::get(Type::getVoidTy(C), Params, false),
+        InPlace ? "HikariStringDecryptChaChaInPlace"
+                : "HikariStringDecryptChaCha");
+    unsigned NumPointers = InPlace ? 1 : 2;
+    for (unsigned i = 0; i < NumPointers; i++) {
+      F->addParamAttr(i, Attribute::NoAlias);
+      F->addParamAttr(i, Attribute::NoCapture);
+    }
+    if (!InPlace)
+      F->addParamAttr(1, Attribute::ReadOnly);
+    F->addParamAttr(NumPointers + 1, Attribute::NoCapture);
+    F->addParamAttr(NumPointers + 1, Attribute::ReadOnly);
+    Value *Dst = F->getArg(0), *Enc = F->getArg(NumPointers - 1),
+          *Len = F->getArg(NumPointers), *KeyPtr = F->getArg(NumPointers + 1);
+    SmallVector<Value *, 3> Nonce = {F->getArg(NumPointers + 2),
+                                     F->getArg(NumPointers + 3),
+                                     F->getArg(NumPointers + 4)};
+    BasicBlock *Entry = BasicBlock::Create(C, "", F);
+    BasicBlock *Groups = BasicBlock::Create(C, "DecryptionLoop", F);
+    BasicBlock *RestGroups = BasicBlock::Create(C, "", F);
+    BasicBlock *Blocks = BasicBlock::Create(C, "DecryptionLoop", F);
+    BasicBlock *Rest = BasicBlock::Create(C, "", F);
+    BasicBlock *LastBlock = BasicBlock::Create(C, "", F);
+    BasicBlock *Tail = BasicBlock::Create(C, "", F);
+    BasicBlock *Exit = BasicBlock::Create(C, "", F);
+    IRBuilder<> IRB(Entry);
+    AllocaInst *Keystream = IRB.CreateAlloca(ArrayType::get(Int32Ty, 16));
+    SmallVector<Value *, 8> Key;
+    for (unsigned i = 0; i < 8; i++)
+      Key.emplace_back(
+          IRB.CreateLoad(Int32Ty, IRB.CreateConstGEP1_32(Int32Ty, KeyPtr, i)));
+    Value *NumBlocks = IRB.CreateLShr(Len, 6);
+    Value *NumGroups = IRB.CreateLShr(Len, 8);
+    Value *EncWords = IRB.CreateBitCast(Enc, Int32Ty->getPointerTo());
+    Value *DstWords = IRB.CreateBitCast(Dst, Int32Ty->getPointerTo());
+    IRB.CreateCondBr(IRB.CreateICmpEQ(NumGroups, ConstantInt::get(Int64Ty, 0)),
+                     RestGroups, Groups);
+    IRB.SetInsertPoint(Groups);
+    PHINode *G = IRB.CreatePHI(Int64Ty, 2);
+    G->addIncoming(ConstantInt::get(Int64Ty, 0), Entry);
+    SmallVector<Value *, 8> SplatKey;
+    for (Value *K : Key)
+      SplatKey.emplace_back(IRB.CreateVectorSplat(4, K));
+    SmallVector<Value *, 3> SplatNonce;
+    for (Value *N : Nonce)
+      SplatNonce.emplace_back(IRB.CreateVectorSplat(4, N));
+    Value *Counters = IRB.CreateAdd(
+        IRB.CreateVectorSplat(4, IRB.CreateTrunc(IRB.CreateShl(G, 2), Int32Ty)),
+        ConstantDataVector::get(C, ArrayRef<uint32_t>({0, 1, 2, 3})));
+    SmallVector<Value *, 16> Words =
+        chachaBlock(IRB, SplatKey, Counters, SplatNonce);
+    // Transpose every four words into four consecutive words of each block
+    Type *VecTy = FixedVectorType::get(Int32Ty, 4);
+    for (unsigned i = 0; i < 16; i += 4) {
+      Value *Lo0 = IRB.CreateShuffleVector(Words[i], Words[i + 1],
+                                           ArrayRef<int>{0, 4, 1, 5});
+      Value *Hi0 = IRB.CreateShuffleVector(Words[i], Words[i + 1],
+                                           ArrayRef<int>{2, 6, 3, 7});
+      Value *Lo1 = IRB.CreateShuffleVector(Words[i + 2], Words[i + 3],
+                                           ArrayRef<int>{0, 4, 1, 5});
+      Value *Hi1 = IRB.CreateShuffleVector(Words[i + 2], Words[i + 3],
+                                           ArrayRef<int>{2, 6, 3, 7});
+      Value *Lanes[4] = {
+          IRB.CreateShuffleVector(Lo0, Lo1, ArrayRef<int>{0, 1, 4, 5}),
+          IRB.CreateShuffleVector(Lo0, Lo1, ArrayRef<int>{2, 3, 6, 7}),
+          IRB.CreateShuffleVector(Hi0, Hi1, ArrayRef<int>{0, 1, 4, 5}),
+          IRB.CreateShuffleVector(Hi0, Hi1, ArrayRef<int>{2, 3, 6, 7})};
+      for (unsigned Lane = 0; Lane < 4; Lane++) {
+        Value *Idx = IRB.CreateAdd(IRB.CreateShl(G, 6),
+                                   ConstantInt::get(Int64Ty, Lane * 16 + i));
+        Value *EncVec = IRB.CreateBitCast(
+            IRB.CreateGEP(Int32Ty, EncWords, Idx), VecTy->getPointerTo());
+        Value *DstVec = IRB.CreateBitCast(
+            IRB.CreateGEP(Int32Ty, DstWords, Idx), VecTy->getPointerTo());
+        IRB.CreateAlignedStore(
+            IRB.CreateXor(IRB.CreateAlignedLoad(VecTy, EncVec, MaybeAlign(1)),
+                          Lanes[Lane]),
+            DstVec, MaybeAlign(1));
+      }
+    }
+    Value *NextG = IRB.CreateAdd(G, ConstantInt::get(Int64Ty, 1));
+    G->addIncoming(NextG, Groups);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(NextG, NumGroups), RestGroups, Groups);
+    IRB.SetInsertPoint(RestGroups);
+    Value *BlocksDone = IRB.CreateShl(NumGroups, 2);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(BlocksDone, NumBlocks), Rest, Blocks);
+    IRB.SetInsertPoint(Blocks);
+    PHINode *J = IRB.CreatePHI(Int64Ty, 2);
+    J->addIncoming(BlocksDone, RestGroups);
+    Words = chachaBlock(IRB, Key, IRB.CreateTrunc(J, Int32Ty), Nonce);
+    for (unsigned i = 0; i < 16; i++) {
+      Value *Idx = IRB.CreateAdd(IRB.CreateShl(J, 4),
+                                 ConstantInt::get(Int64Ty, i));
+      IRB.CreateAlignedStore(
+          IRB.CreateXor(IRB.CreateAlignedLoad(
+                            Int32Ty, IRB.CreateGEP(Int32Ty, EncWords, Idx),
+                            MaybeAlign(1)),
+                        Words[i]),
+          IRB.CreateGEP(Int32Ty, DstWords, Idx), MaybeAlign(1));
+    }
+    Value *NextJ = IRB.CreateAdd(J, ConstantInt::get(Int64Ty, 1));
+    J->addIncoming(NextJ, Blocks);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(NextJ, NumBlocks), Rest, Blocks);
+    IRB.SetInsertPoint(Rest);
+    Value *Done = IRB.CreateShl(NumBlocks, 6);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(Done, Len), Exit, LastBlock);
+    // The bytes of the last block are taken from its words in memory
+    IRB.SetInsertPoint(LastBlock);
+    Words = chachaBlock(IRB, Key, IRB.CreateTrunc(NumBlocks, Int32Ty), Nonce);
+    for (unsigned i = 0; i < 16; i++)
+      IRB.CreateStore(Words[i], IRB.CreateConstGEP2_32(
+                                    Keystream->getAllocatedType(), Keystream,
+                                    0, i));
+    Value *KeystreamBytes = IRB.CreateBitCast(Keystream, Int8PtrTy);
+    IRB.CreateBr(Tail);
+    IRB.SetInsertPoint(Tail);
+    PHINode *I = IRB.CreatePHI(Int64Ty, 2);
+    I->addIncoming(Done, LastBlock);
+    Value *K = IRB.CreateLoad(
+        Int8Ty, IRB.CreateGEP(Int8Ty, KeystreamBytes, IRB.CreateSub(I, Done)));
+    Value *E = IRB.CreateLoad(Int8Ty, IRB.CreateGEP(Int8Ty, Enc, I));
+    IRB.CreateStore(IRB.CreateXor(E, K), IRB.CreateGEP(Int8Ty, Dst, I));
+    Value *NextI = IRB.CreateAdd(I, ConstantInt::get(Int64Ty, 1));
+    I->addIncoming(NextI, Tail);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(NextI, Len), Exit, Tail);
+    ReturnInst::Create(C, Exit);
+    chacharoutine = F;
+    return F;
+  }
+
+  /* CompressString
+   *
+   * LZ77 of the bytes of CDS in the order of the target's memory. A command
+   * byte c < 128 is followed by c + 1 literal bytes, c >= 128 copies c - 125
+   * bytes from a distance back in the output given by the two little endian
+   * bytes after it. Matches are found through the last position of every
+   * hash of three bytes. False if nothing is saved.
+   */
+  static bool CompressString(ConstantDataSequential *CDS, bool LittleEndian,
+                             std::vector<uint8_t> &Out) {
+    unsigned ElementSize = CDS->getElementByteSize();
+    std::vector<uint8_t> Data;
+    for (unsigned i = 0; i < CDS->getNumElements(); i++) {
+      uint64_t V = CDS->getElementAsInteger(i);
+      for (unsigned b = 0; b < ElementSize; b++)
+        Data.emplace_back(V >> (8 * (LittleEndian ? b : ElementSize - 1 - b)));
+    }
+    std::vector<int64_t> Head(1 << 16, -1);
+    auto Hash = [&](uint64_t i) {
+      return (uint32_t)((Data[i] << 16) | (Data[i + 1] << 8) | Data[i + 2]) *
+                 2654435761U >>
+             16;
+    };
+    uint64_t i = 0, Literals = 0;
+    auto FlushLiterals = [&]() {
+      while (Literals < i) {
+        uint64_t N = std::min<uint64_t>(128, i - Literals);
+        Out.emplace_back(N - 1);
+        Out.insert(Out.end(), Data.begin() + Literals,
+                   Data.begin() + Literals + N);
+        Literals += N;
+      }
+    };
+    while (i + 3 <= Data.size()) {
+      int64_t Candidate = Head[Hash(i)];
+      Head[Hash(i)] = i;
+      if (Candidate < 0 || i - Candidate > 0xFFFF ||
+          !std::equal(Data.begin() + Candidate, Data.begin() + Candidate + 3,
+                      Data.begin() + i)) {
+        i++;
+        continue;
+      }
+      uint64_t Len = 3;
+      while (Len < 130 && i + Len < Data.size() &&
+             Data[Candidate + Len] == Data[i + Len])
+        Len++;
+      FlushLiterals();
+      uint64_t Distance = i - Candidate;
+      Out.insert(Out.end(), {(uint8_t)(125 + Len), (uint8_t)Distance,
+                             (uint8_t)(Distance >> 8)});
+      for (uint64_t j = i + 1; j < i + Len && j + 3 <= Data.size(); j++)
+        Head[Hash(j)] = j;
+      i += Len;
+      Literals = i;
+    }
+    i = Data.size();
+    FlushLiterals();
+    if (Out.size() < Data.size())
+      return true;
+    Out.clear();
+    return false;
+  }
+
+  /* getDecompressionRoutine
+   *
+   * void HikariStringDecompress(i8 *dst, i8 *enc, i64 len, i32 seed)
+   * Decodes the output of CompressString from enc into the len bytes of dst.
+   * Byte i of enc is XORed with byte i % 4 of the keystream word i / 4 of
+   * seed, in little endian order on every target.
+   */
+  Function *getDecompressionRoutine(Module *M) {
+    if (decompressroutine)
+      return decompressroutine;
+    LLVMContext &C = M->getContext();
+    Type *Int8Ty = Type::getInt8Ty(C);
+    Type *Int32Ty = Type::getInt32Ty(C);
+    Type *Int64Ty = Type::getInt64Ty(C);
+    Type *Int8PtrTy = Type::getInt8PtrTy(C);
+    Function *F = createRuntimeFunction(
+        M,
+        FunctionType::get(Type::getVoidTy(C),
+                          {Int8PtrTy, Int8PtrTy, Int64Ty, Int32Ty}, false),
+        "HikariStringDecompress");
+    for (unsigned i = 0; i < 2; i++) {
+      F->addParamAttr(i, Attribute::NoAlias);
+      F->addParamAttr(i, Attribute::NoCapture);
+    }
+    F->addParamAttr(1, Attribute::ReadOnly);
+    Value *Dst = F->getArg(0), *Enc = F->getArg(1), *Len = F->getArg(2),
+          *Seed = F->getArg(3);
+    BasicBlock *Entry = BasicBlock::Create(C, "", F);
+    BasicBlock *Command = BasicBlock::Create(C, "DecompressionLoop", F);
+    BasicBlock *Literal = BasicBlock::Create(C, "", F);
+    BasicBlock *LiteralCopy = BasicBlock::Create(C, "", F);
+    BasicBlock *Match = BasicBlock::Create(C, "", F);
+    BasicBlock *MatchCopy = BasicBlock::Create(C, "", F);
+    BasicBlock *Next = BasicBlock::Create(C, "", F);
+    BasicBlock *Exit = BasicBlock::Create(C, "", F);
+    IRBuilder<> IRB(Entry);
+    auto DecryptByte = [&](Value *I) {
+      Value *Word = IRB.CreateTrunc(IRB.CreateLShr(I, 2), Int32Ty);
+      Value *W = hashKeystream(
+          IRB, IRB.CreateAdd(IRB.CreateMul(
+                                 Word, ConstantInt::get(Int32Ty, 0x9E3779B9)),
+                             Seed));
+      Value *Shift = IRB.CreateShl(
+          IRB.CreateTrunc(IRB.CreateAnd(I, ConstantInt::get(Int64Ty, 3)),
+                          Int32Ty),
+          3);
+      return IRB.CreateXor(
+          IRB.CreateLoad(Int8Ty, IRB.CreateGEP(Int8Ty, Enc, I)),
+          IRB.CreateTrunc(IRB.CreateLShr(W, Shift), Int8Ty));
+    };
+    Constant *Zero = ConstantInt::get(Int64Ty, 0);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(Len, Zero), Exit, Command);
+    // Command
+    IRB.SetInsertPoint(Command);
+    PHINode *In = IRB.CreatePHI(Int64Ty, 2);
+    PHINode *Out = IRB.CreatePHI(Int64Ty, 2);
+    In->addIncoming(Zero, Entry);
+    Out->addIncoming(Zero, Entry);
+    Value *Cmd = IRB.CreateZExt(DecryptByte(In), Int64Ty);
+    IRB.CreateCondBr(IRB.CreateICmpULT(Cmd, ConstantInt::get(Int64Ty, 128)),
+                     Literal, Match);
+    // Literal
+    IRB.SetInsertPoint(Literal);
+    Value *LiteralLen = IRB.CreateAdd(Cmd, ConstantInt::get(Int64Ty, 1));
+    Value *LiteralIn = IRB.CreateAdd(In, ConstantInt::get(Int64Ty, 1));
+    Value *LiteralEnd = IRB.CreateAdd(LiteralIn, LiteralLen);
+    IRB.CreateBr(LiteralCopy);
+    IRB.SetInsertPoint(LiteralCopy);
+    PHINode *K = IRB.CreatePHI(Int64Ty, 2);
+    K->addIncoming(Zero, Literal);
+    IRB.CreateStore(DecryptByte(IRB.CreateAdd(LiteralIn, K)),
+                    IRB.CreateGEP(Int8Ty, Dst, IRB.CreateAdd(Out, K)));
+    Value *NextK = IRB.CreateAdd(K, ConstantInt::get(Int64Ty, 1));
+    K->addIncoming(NextK, LiteralCopy);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(NextK, LiteralLen), Next, LiteralCopy);
+    // Match
+    IRB.SetInsertPoint(Match);
+    Value *MatchLen = IRB.CreateSub(Cmd, ConstantInt::get(Int64Ty, 125));
+    Value *Distance = IRB.CreateOr(
+        IRB.CreateZExt(
+            DecryptByte(IRB.CreateAdd(In, ConstantInt::get(Int64Ty, 1))),
+            Int64Ty),
+        IRB.CreateShl(
+            IRB.CreateZExt(
+                DecryptByte(IRB.CreateAdd(In, ConstantInt::get(Int64Ty, 2))),
+                Int64Ty),
+            8));
+    Value *From = IRB.CreateSub(Out, Distance);
+    Value *MatchEnd = IRB.CreateAdd(In, ConstantInt::get(Int64Ty, 3));
+    IRB.CreateBr(MatchCopy);
+    // Byte by byte, the match may overlap the bytes it produces
+    IRB.SetInsertPoint(MatchCopy);
+    PHINode *J = IRB.CreatePHI(Int64Ty, 2);
+    J->addIncoming(Zero, Match);
+    IRB.CreateStore(
+        IRB.CreateLoad(Int8Ty,
+                       IRB.CreateGEP(Int8Ty, Dst, IRB.CreateAdd(From, J))),
+        IRB.CreateGEP(Int8Ty, Dst, IRB.CreateAdd(Out, J)));
+    Value *NextJ = IRB.CreateAdd(J, ConstantInt::get(Int64Ty, 1));
+    J->addIncoming(NextJ, MatchCopy);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(NextJ, MatchLen), Next, MatchCopy);
+    // Next command
+    IRB.SetInsertPoint(Next);
+    PHINode *NextIn = IRB.CreatePHI(Int64Ty, 2);
+    NextIn->addIncoming(LiteralEnd, LiteralCopy);
+    NextIn->addIncoming(MatchEnd, MatchCopy);
+    PHINode *Copied = IRB.CreatePHI(Int64Ty, 2);
+    Copied->addIncoming(LiteralLen, LiteralCopy);
+    Copied->addIncoming(MatchLen, MatchCopy);
+    Value *NextOut = IRB.CreateAdd(Out, Copied);
+    In->addIncoming(NextIn, Next);
+    Out->addIncoming(NextOut, Next);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(NextOut, Len), Exit, Command);
+    ReturnInst::Create(C, Exit);
+    decompressroutine = F;
+    return F;
+  }
+
+  /* EncryptWithKeystream
+   *
+   * XOR the bytes of CDS, in the order of the target's memory, with the
+   * keystream whose word j is Word(j). Every keystream word covers four
+   * bytes and is stored in the target's byte order.
+   */
+  void EncryptWithKeystream(ConstantDataSequential *CDS,
+                            function_ref<uint32_t(uint64_t)> Word,
+                            bool LittleEndian, Constant *&EncryptedConst,
+                            Constant *&DummyConst) {
+    unsigned ElementSize = CDS->getElementByteSize();
+    std::vector<uint8_t> Bytes;
+    for (unsigned i = 0; i < CDS->getNumElements(); i++) {
+      uint64_t V = CDS->getElementAsInteger(i);
+      for (unsigned b = 0; b < ElementSize; b++)
+        Bytes.emplace_back(V >> (8 * (LittleEndian ? b : ElementSize - 1 - b)));
+    }
+    for (uint64_t i = 0; i < Bytes.size(); i++) {
+      uint32_t W = Word(i / 4);
+      Bytes[i] ^= W >> (8 * (LittleEndian ? i % 4 : 3 - i % 4));
+    }
+    uint64_t Mask = ElementSize == 8 ? ~0ULL : (1ULL << (8 * ElementSize)) - 1;
+    std::vector<Constant *> Encrypted, Dummy;
+    for (unsigned i = 0; i < CDS->getNumElements(); i++) {
+      uint64_t V = 0;
+      for (unsigned b = 0; b < ElementSize; b++)
+        V |= (uint64_t)Bytes[i * ElementSize + b]
+             << (8 * (LittleEndian ? b : ElementSize - 1 - b));
+      Encrypted.emplace_back(ConstantInt::get(CDS->getElementType(), V));
+      Dummy.emplace_back(ConstantInt::get(CDS->getElementType(),
+                                          cryptoutils->get_uint64_t() & Mask));
+    }
+    // Folds back into a ConstantDataArray
+    EncryptedConst = ConstantArray::get(
+        ArrayType::get(CDS->getElementType(), Encrypted.size()), Encrypted);
+    DummyConst = ConstantArray::get(
+        ArrayType::get(CDS->getElementType(), Dummy.size()), Dummy);
+  }
+
+  /* getKeystreamRoutine
+   *
+   * void HikariStringDecryptKeystream(i8 *dst, i8 *enc, i64 len, i32 seed)
+   * XORs len bytes of enc with the keystream of seed into dst, a word at a
+   * time so that the vectorizer can hash several words at once, then the
+   * bytes of the last partial word. Decrypting in place enc is dst and left
+   * out.
+   */
+  Function *getKeystreamRoutine(Module *M, bool DecryptInPlace) {
+    if (keystreamroutines[DecryptInPlace])
+      return keystreamroutines[DecryptInPlace];
+    LLVMContext &C = M->getContext();
+    bool LittleEndian = M->getDataLayout().isLittleEndian();
+    Type *Int8Ty = Type::getInt8Ty(C);
+    Type *Int32Ty = Type::getInt32Ty(C);
+    Type *Int64Ty = Type::getInt64Ty(C);
+    Type *Int8PtrTy = Type::getInt8PtrTy(C);
+    std::vector<Type *> Params = {Int8PtrTy, Int8PtrTy, Int64Ty, Int32Ty};
+    if (DecryptInPlace)
+      Params.erase(Params.begin() + 1);
+    Function *F = createRuntimeFunction(
+        M, FunctionType::get(Type::getVoidTy(C), Params, false),
+        DecryptInPlace ? "HikariStringDecryptKeystreamInPlace"
+                       : "HikariStringDecryptKeystream");
+    unsigned NumPointers = DecryptInPlace ? 1 : 2;
+    for (unsigned i = 0; i < NumPointers; i++) {
+      F->addParamAttr(i, Attribute::NoAlias);
+      F->addParamAttr(i, Attribute::NoCapture);
+    }
+    if (!DecryptInPlace)
+      F->addParamAttr(1, Attribute::ReadOnly);
+    Value *Dst = F->getArg(0), *Enc = F->getArg(NumPointers - 1),
+          *Len = F->getArg(NumPointers), *Seed = F->getArg(NumPointers + 1);
+    Constant *Golden = ConstantInt::get(Int32Ty, 0x9E3779B9);
+    BasicBlock *Entry = BasicBlock::Create(C, "", F);
+    BasicBlock *Words = BasicBlock::Create(C, "DecryptionLoop", F);
+    BasicBlock *Rest = BasicBlock::Create(C, "", F);
+    BasicBlock *Tail = BasicBlock::Create(C, "", F);
+    BasicBlock *Exit = BasicBlock::Create(C, "", F);
+    IRBuilder<> IRB(Entry);
+    Value *NumWords = IRB.CreateLShr(Len, 2);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(NumWords, ConstantInt::get(Int64Ty, 0)),
+                     Rest, Words);
+    IRB.SetInsertPoint(Words);
+    PHINode *J = IRB.CreatePHI(Int64Ty, 2);
+    J->addIncoming(ConstantInt::get(Int64Ty, 0), Entry);
+    Value *W = hashKeystream(
+        IRB, IRB.CreateAdd(IRB.CreateMul(IRB.CreateTrunc(J, Int32Ty), Golden),
+                           Seed));
+    Value *EncWord = IRB.CreateGEP(
+        Int32Ty, IRB.CreateBitCast(Enc, Int32Ty->getPointerTo()), J);
+    Value *DstWord = IRB.CreateGEP(
+        Int32Ty, IRB.CreateBitCast(Dst, Int32Ty->getPointerTo()), J);
+    IRB.CreateAlignedStore(
+        IRB.CreateXor(IRB.CreateAlignedLoad(Int32Ty, EncWord, MaybeAlign(1)),
+                      W),
+        DstWord, MaybeAlign(1));
+    Value *NextJ = IRB.CreateAdd(J, ConstantInt::get(Int64Ty, 1));
+    J->addIncoming(NextJ, Words);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(NextJ, NumWords), Rest, Words);
+    IRB.SetInsertPoint(Rest);
+    Value *Done = IRB.CreateMul(NumWords, ConstantInt::get(Int64Ty, 4));
+    Value *LastW = hashKeystream(
+        IRB, IRB.CreateAdd(
+                 IRB.CreateMul(IRB.CreateTrunc(NumWords, Int32Ty), Golden),
+                 Seed));
+    IRB.CreateCondBr(IRB.CreateICmpEQ(Done, Len), Exit, Tail);
+    IRB.SetInsertPoint(Tail);
+    PHINode *I = IRB.CreatePHI(Int64Ty, 2);
+    I->addIncoming(Done, Rest);
+    Value *Shift = IRB.CreateShl(
+        IRB.CreateTrunc(IRB.CreateAnd(I, ConstantInt::get(Int64Ty, 3)),
+                        Int32Ty),
+        3);
+    if (!LittleEndian)
+      Shift = IRB.CreateSub(ConstantInt::get(Int32Ty, 24), Shift);
+    Value *K = IRB.CreateTrunc(IRB.CreateLShr(LastW, Shift), Int8Ty);
+    Value *E = IRB.CreateLoad(Int8Ty, IRB.CreateGEP(Int8Ty, Enc, I));
+    IRB.CreateStore(IRB.CreateXor(E, K), IRB.CreateGEP(Int8Ty, Dst, I));
+    Value *NextI = IRB.CreateAdd(I, ConstantInt::get(Int64Ty, 1));
+    I->addIncoming(NextI, Tail);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(NextI, Len), Exit, Tail);
+    ReturnInst::Create(C, Exit);
+    keystreamroutines[DecryptInPlace] = F;
+    return F;
+  }
+
+  /* getDecryptionRoutine
+   *
+   * void HikariStringDecrypt(i8 *dst, i8 *enc, i8 *key, i64 len)
+   * XORs len bytes of enc and key into dst. The loop is left to the
+   * vectorizer, so the other passes must not touch it. With -strcry_inplace
+   * enc is dst and left out.
+   */
+  Function *getDecryptionRoutine(Module *M) {
+    if (decryptroutine)
+      return decryptroutine;
+    LLVMContext &C = M->getContext();
+    Type *Int8Ty = Type::getInt8Ty(C);
+    Type *Int8PtrTy = Type::getInt8PtrTy(C);
+    Type *Int64Ty = Type::getInt64Ty(C);
+    std::vector<Type *> Params = {Int8PtrTy, Int8PtrTy, Int8PtrTy, Int64Ty};
+    if (InPlace)
+      Params.erase(Params.begin() + 1);
+    FunctionType *FTy = FunctionType::get(Type::getVoidTy(C), Params, false);
+    Function *F = createRuntimeFunction(
+        M, FTy, InPlace ? "HikariStringDecryptInPlace" : "HikariStringDecrypt");
+    unsigned NumPointers = InPlace ? 2 : 3;
+    for (unsigned i = 0; i < NumPointers; i++) {
+      F->addParamAttr(i, Attribute::NoAlias);
+      F->addParamAttr(i, Attribute::NoCapture);
+    }
+    for (unsigned i = 1; i < NumPointers; i++)
+      F->addParamAttr(i, Attribute::ReadOnly);
+    Value *Dst = F->getArg(0), *Enc = F->getArg(NumPointers - 2),
+          *Key = F->getArg(NumPointers - 1), *Len = F->getArg(NumPointers);
+    BasicBlock *Entry = BasicBlock::Create(C, "", F);
+    BasicBlock *Body = BasicBlock::Create(C, "DecryptionLoop", F);
+    BasicBlock *Exit = BasicBlock::Create(C, "", F);
+    IRBuilder<> IRB(Entry);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(Len, ConstantInt::get(Int64Ty, 0)), Exit,
+                     Body);
+    IRB.SetInsertPoint(Body);
+    PHINode *Idx = IRB.CreatePHI(Int64Ty, 2);
+    Idx->addIncoming(ConstantInt::get(Int64Ty, 0), Entry);
+    Value *E = IRB.CreateLoad(Int8Ty, IRB.CreateGEP(Int8Ty, Enc, Idx));
+    Value *K = IRB.CreateLoad(Int8Ty, IRB.CreateGEP(Int8Ty, Key, Idx));
+    IRB.CreateStore(IRB.CreateXor(E, K), IRB.CreateGEP(Int8Ty, Dst, Idx));
+    Value *Next = IRB.CreateAdd(Idx, ConstantInt::get(Int64Ty, 1));
+    Idx->addIncoming(Next, Body);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(Next, Len), Exit, Body);
+    ReturnInst::Create(C, Exit);
+    decryptroutine = F;
+    return F;
+  }
+
+  // Instructions of Func reading or passing on V, looking through constant
+  // expressions and address computations. Other functions sharing V guard
+  // their own uses. False if V is referenced by anything but instructions.
+  bool collectUses(Value *V, Function *Func, std::set<Value *> &Visited,
+                   std::vector<Instruction *> &Points) {
+    if (!Visited.insert(V).second)
+      return true;
+    for (User *U : V->users()) {
+      if (ConstantExpr *CE = dyn_cast<ConstantExpr>(U)) {
+        if (!collectUses(CE, Func, Visited, Points))
+          return false;
+        continue;
+      }
+      Instruction *I = dyn_cast<Instruction>(U);
+      if (!I)
+        return false;
+      if (I->getFunction() != Func)
+        continue;
+      if (isa<GetElementPtrInst>(I) || isa<BitCastInst>(I) ||
+          isa<AddrSpaceCastInst>(I) || isa<PHINode>(I) ||
+          isa<SelectInst>(I)) {
+        if (!collectUses(I, Func, Visited, Points))
+          return false;
+      } else
+        Points.emplace_back(I);
+    }
+    return true;
+  }
+
+  /* HandleLazyDecryption
+   *
+   * Strings only used by instructions are moved out of GV2Keys and
+   * decrypted right before their uses in Func, so strings of cold paths are
+   * only decrypted once these run. Every string gets its own status, uses
+   * dominated by another use of the same string don't need a check. Strings
+   * referenced by other globals are left to the function entry.
+   */
+  void HandleLazyDecryption(
+      Function *Func,
+      std::map<GlobalVariable *, std::pair<Constant *, GlobalVariable *>>
+          &GV2Keys) {
+    DominatorTree DT(*Func);
+    std::vector<std::pair<GlobalVariable *, std::vector<Instruction *>>>
+        LazyStrings;
+    std::map<GlobalVariable *, std::pair<Constant *, GlobalVariable *>>
+        LazyKeys;
+    for (std::map<GlobalVariable *,
+                  std::pair<Constant *, GlobalVariable *>>::iterator iter =
+             GV2Keys.begin();
+         iter != GV2Keys.end();) {
+      GlobalVariable *DecryptSpace = iter->first;
+      DecryptSpace->removeDeadConstantUsers();
+      std::set<Value *> Visited;
+      std::vector<Instruction *> Points;
+      if (!collectUses(DecryptSpace, Func, Visited, Points) ||
+          Points.empty()) {
+        ++iter;
+        continue;
+      }
+      std::sort(Points.begin(), Points.end());
+      Points.erase(std::unique(Points.begin(), Points.end()), Points.end());
+      std::vector<Instruction *> Guards;
+      for (Instruction *P : Points)
+        if (std::none_of(Points.begin(), Points.end(), [&](Instruction *Q) {
+              return Q != P && DT.dominates(Q, P);
+            }))
+          Guards.emplace_back(P);
+      LazyStrings.emplace_back(DecryptSpace, Guards);
+      LazyKeys[DecryptSpace] = iter->second;
+      iter = GV2Keys.erase(iter);
+    }
+    for (std::pair<GlobalVariable *, std::vector<Instruction *>> &LS :
+         LazyStrings) {
+      std::map<GlobalVariable *, std::pair<Constant *, GlobalVariable *>>
+          Keys = {{LS.first, LazyKeys[LS.first]}};
+      for (Instruction *P : LS.second)
+        InsertDecryptionGuard(P, getStringStatus(LS.first), Keys);
+    }
+  }
+
+  /* HandleChunkedDecryption
+   *
+   * Chunked strings only used by instructions are moved out of GV2Keys.
+   * Loads and stores decrypt the chunks they access right before, every
+   * other use the whole string. Uses dominated by one decrypting the whole
+   * string need nothing. Strings referenced by other globals are left to
+   * the function entry.
+   */
+  void HandleChunkedDecryption(
+      Function *Func,
+      std::map<GlobalVariable *, std::pair<Constant *, GlobalVariable *>>
+          &GV2Keys) {
+    DominatorTree DT(*Func);
+    std::vector<std::tuple<GlobalVariable * /*Decrypt Space*/,
+                           Instruction * /*Use*/, Value * /*Accessed*/>>
+        Guards;
+    for (std::map<GlobalVariable *,
+                  std::pair<Constant *, GlobalVariable *>>::iterator iter =
+             GV2Keys.begin();
+         iter != GV2Keys.end();) {
+      GlobalVariable *DecryptSpace = iter->first;
+      if (!chunkstatus.count(DecryptSpace)) {
+        ++iter;
+        continue;
+      }
+      DecryptSpace->removeDeadConstantUsers();
+      std::set<Value *> Visited;
+      std::vector<Instruction *> Points;
+      if (!collectUses(DecryptSpace, Func, Visited, Points) ||
+          Points.empty()) {
+        ++iter;
+        continue;
+      }
+      std::sort(Points.begin(), Points.end());
+      Points.erase(std::unique(Points.begin(), Points.end()), Points.end());
+      std::vector<Instruction *> Whole;
+      for (Instruction *P : Points)
+        if (!getAccessedPointer(P, Visited))
+          Whole.emplace_back(P);
+      for (Instruction *P : Points)
+        if (std::none_of(Whole.begin(), Whole.end(), [&](Instruction *W) {
+              return W != P && DT.dominates(W, P);
+            }))
+          Guards.emplace_back(DecryptSpace, P,
+                              getAccessedPointer(P, Visited));
+      iter = GV2Keys.erase(iter);
+    }
+    for (std::tuple<GlobalVariable *, Instruction *, Value *> &G : Guards)
+      InsertChunkGuard(std::get<1>(G), std::get<0>(G), std::get<2>(G));
+  }
+
+  // The pointer derived from the string that P only loads from or stores to
+  static Value *getAccessedPointer(Instruction *P,
+                                   std::set<Value *> &Derived) {
+    if (!isa<LoadInst>(P) && !isa<StoreInst>(P))
+      return nullptr;
+    if (isa<ScalableVectorType>(getLoadStoreType(P)))
+      return nullptr;
+    if (StoreInst *SI = dyn_cast<StoreInst>(P))
+      if (Derived.count(SI->getValueOperand()))
+        return nullptr;
+    return getLoadStorePointerOperand(P);
+  }
+
+  /* InsertChunkGuard
+   *
+   * Decrypt the chunks of DecryptSpace that P accesses through Accessed in
+   * front of it, or all of them without Accessed. Accesses check the status
+   * of their chunks inline, the first and the last one if they may straddle
+   * two:
+   *     A (Check chunk statuses)
+   *     |
+   *     B (Decrypt unless done)
+   *     |
+   *     C
+   */
+  void InsertChunkGuard(Instruction *P, GlobalVariable *DecryptSpace,
+                        Value *Accessed) {
+    Module *M = P->getModule();
+    LLVMContext &Ctx = M->getContext();
+    const DataLayout &DL = M->getDataLayout();
+    Type *Int32Ty = Type::getInt32Ty(Ctx);
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    Type *Int8PtrTy = Type::getInt8PtrTy(Ctx);
+    uint64_t Size = DL.getTypeAllocSize(DecryptSpace->getValueType());
+    IRBuilder<> IRB(P);
+    Value *Status = IRB.CreatePointerCast(chunkstatus[DecryptSpace],
+                                          Int32Ty->getPointerTo());
+    std::vector<Value *> Args = {
+        IRB.CreatePointerCast(DecryptSpace, Int8PtrTy),
+        IRB.CreatePointerCast(mgv2keys[DecryptSpace].second, Int8PtrTy),
+        ConstantInt::get(Int64Ty, Size), mgv2keys[DecryptSpace].first, Status};
+    if (!Accessed) {
+      Args.insert(Args.end(), {ConstantInt::get(Int64Ty, 0),
+                               ConstantInt::get(Int64Ty, Size)});
+      IRB.CreateCall(getChunkRoutine(M), Args);
+      return;
+    }
+    uint64_t AccessSize = DL.getTypeStoreSize(getLoadStoreType(P));
+    Value *Begin = IRB.CreateSub(IRB.CreatePtrToInt(Accessed, Int64Ty),
+                                 IRB.CreatePtrToInt(DecryptSpace, Int64Ty));
+    Value *End = IRB.CreateAdd(Begin, ConstantInt::get(Int64Ty, AccessSize));
+    // Out of range offsets check the last chunk, the routine ignores them
+    auto IsDecrypted = [&](Value *Offset) {
+      Constant *Last = ConstantInt::get(Int64Ty, Size - 1);
+      Value *Chunk = IRB.CreateLShr(
+          IRB.CreateSelect(IRB.CreateICmpULT(Offset, Last), Offset, Last),
+          Log2_32(ChunkSize));
+      LoadInst *LI = IRB.CreateLoad(
+          Int32Ty, IRB.CreateGEP(Int32Ty, Status, Chunk), "LoadChunkStatus");
+      LI->setAtomic(AtomicOrdering::Acquire);
+      LI->setAlignment(Align(4));
+      return IRB.CreateICmpEQ(LI, ConstantInt::get(Int32Ty, 2));
+    };
+    Value *Decrypted = IsDecrypted(Begin);
+    Align AccessAlign = commonAlignment(getLoadStoreAlignment(P),
+                                        DecryptSpace->getPointerAlignment(DL));
+    if (!isPowerOf2_64(AccessSize) || AccessSize > AccessAlign.value() ||
+        AccessSize > ChunkSize)
+      Decrypted = IRB.CreateAnd(
+          Decrypted,
+          IsDecrypted(IRB.CreateSub(End, ConstantInt::get(Int64Ty, 1))));
+    BasicBlock *A = P->getParent();
+    BasicBlock *C = splitBlockBefore(P);
+    BasicBlock *B =
+        BasicBlock::Create(Ctx, "StringDecryptionBB", P->getFunction(), C);
+    IRB.SetInsertPoint(A->getTerminator());
+    IRB.CreateCondBr(Decrypted, C, B);
+    A->getTerminator()->eraseFromParent();
+    IRB.SetInsertPoint(B);
+    Args.insert(Args.end(), {Begin, End});
+    IRB.CreateCall(getChunkRoutine(M), Args);
+    IRB.CreateBr(C);
+  }
+
+  /* getChunkRoutine
+   *
+   * void HikariStringDecryptChunks(i8 *dst, i8 *enc, i64 len, i32 seed,
+   *                                i32 *status, i64 begin, i64 end)
+   * Decrypts the chunks of dst holding bytes begin to end from enc that are
+   * not decrypted yet. Every chunk has a status of its own, taken with the
+   * lock routine, so that only one thread decrypts it while the others wait
+   * and a decrypted chunk is never written again. Bytes out of range are
+   * ignored.
+   */
+  Function *getChunkRoutine(Module *M) {
+    if (chunkroutine)
+      return chunkroutine;
+    LLVMContext &C = M->getContext();
+    Type *Int8Ty = Type::getInt8Ty(C);
+    Type *Int32Ty = Type::getInt32Ty(C);
+    Type *Int64Ty = Type::getInt64Ty(C);
+    Type *Int8PtrTy = Type::getInt8PtrTy(C);
+    Function *F = createRuntimeFunction(
+        M,
+        FunctionType::get(Type::getVoidTy(C),
+                          {Int8PtrTy, Int8PtrTy, Int64Ty, Int32Ty,
+                           Int32Ty->getPointerTo(), Int64Ty, Int64Ty},
+                          false),
+        "HikariStringDecryptChunks");
+    Value *Dst = F->getArg(0), *Enc = F->getArg(1), *Len = F->getArg(2),
+          *Seed = F->getArg(3), *Status = F->getArg(4), *Begin = F->getArg(5),
+          *End = F->getArg(6);
+    unsigned Shift = Log2_32(ChunkSize);
+    BasicBlock *Entry = BasicBlock::Create(C, "", F);
+    BasicBlock *Check = BasicBlock::Create(C, "ChunkLoop", F);
+    BasicBlock *Lock = BasicBlock::Create(C, "", F);
+    BasicBlock *Decrypt = BasicBlock::Create(C, "", F);
+    BasicBlock *Next = BasicBlock::Create(C, "", F);
+    BasicBlock *Exit = BasicBlock::Create(C, "", F);
+    IRBuilder<> IRB(Entry);
+    End = IRB.CreateSelect(IRB.CreateICmpULT(End, Len), End, Len);
+    Value *First = IRB.CreateLShr(Begin, Shift);
+    Value *Last =
+        IRB.CreateLShr(IRB.CreateSub(End, ConstantInt::get(Int64Ty, 1)), Shift);
+    IRB.CreateCondBr(IRB.CreateICmpULT(Begin, End), Check, Exit);
+    IRB.SetInsertPoint(Check);
+    PHINode *Chunk = IRB.CreatePHI(Int64Ty, 2);
+    Chunk->addIncoming(First, Entry);
+    Value *ChunkStatus = IRB.CreateGEP(Int32Ty, Status, Chunk);
+    LoadInst *LI = IRB.CreateLoad(Int32Ty, ChunkStatus);
+    LI->setAtomic(AtomicOrdering::Acquire);
+    LI->setAlignment(Align(4));
+    IRB.CreateCondBr(IRB.CreateICmpEQ(LI, ConstantInt::get(Int32Ty, 2)), Next,
+                     Lock);
+    IRB.SetInsertPoint(Lock);
+    IRB.CreateCondBr(IRB.CreateCall(getLockRoutine(M), {ChunkStatus}), Decrypt,
+                     Next);
+    IRB.SetInsertPoint(Decrypt);
+    // Chunks start at a keystream word, the seed is moved along to it
+    Value *Offset = IRB.CreateShl(Chunk, Shift);
+    Value *Remaining = IRB.CreateSub(Len, Offset);
+    Constant *Size = ConstantInt::get(Int64Ty, ChunkSize);
+    IRB.CreateCall(
+        getKeystreamRoutine(M, false),
+        {IRB.CreateGEP(Int8Ty, Dst, Offset), IRB.CreateGEP(Int8Ty, Enc, Offset),
+         IRB.CreateSelect(IRB.CreateICmpULT(Remaining, Size), Remaining, Size),
+         IRB.CreateAdd(
+             Seed,
+             IRB.CreateMul(IRB.CreateTrunc(IRB.CreateLShr(Offset, 2), Int32Ty),
+                           ConstantInt::get(Int32Ty, 0x9E3779B9)))});
+    IRB.CreateCall(getUnlockRoutine(M), {ChunkStatus});
+    IRB.CreateBr(Next);
+    IRB.SetInsertPoint(Next);
+    Value *NextChunk = IRB.CreateAdd(Chunk, ConstantInt::get(Int64Ty, 1));
+    Chunk->addIncoming(NextChunk, Next);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(Chunk, Last), Exit, Check);
+    ReturnInst::Create(C, Exit);
+    chunkroutine = F;
+    return F;
+  }
+
+  GlobalVariable *getStringStatus(GlobalVariable *DecryptSpace) {
+    GlobalVariable *&StatusGV = stringstatus[DecryptSpace];
+    if (!StatusGV) {
+      Type *Int32Ty = Type::getInt32Ty(DecryptSpace->getContext());
+      StatusGV = new GlobalVariable(
+          *DecryptSpace->getParent(), Int32Ty, false,
+          GlobalValue::LinkageTypes::PrivateLinkage,
+          ConstantInt::getNullValue(Int32Ty), "StringEncryptionEncStatus");
+    }
+    return StatusGV;
+  }
+
+  /* InsertDecryptionGuard
+   *
+   * Split the block of P in front of it and decrypt Keys on the way unless
+   * StatusGV says they were decrypted before:
+   *     A (Check status)
+   *     |
+   *     L (Lock unless decrypted)
+   *     |
+   *     B (If we hold the lock)
+   *     |
+   *     C
+   * The status is 0 before, 1 (3 with waiters) during and 2 after the
+   * decryption, only one thread decrypts and everyone else waits for it.
+   */
+  void InsertDecryptionGuard(
+      Instruction *P, GlobalVariable *StatusGV,
+      std::map<GlobalVariable *, std::pair<Constant *, GlobalVariable *>>
+          &Keys) {
+    Function *Func = P->getFunction();
+    Type *Int32Ty = Type::getInt32Ty(Func->getContext());
+    BasicBlock *A = P->getParent();
+    BasicBlock *C = splitBlockBefore(P);
+    BasicBlock *L = BasicBlock::Create(Func->getContext(),
+                                       "StringDecryptionLockBB", Func, C);
     BasicBlock *B =
         BasicBlock::Create(Func->getContext(), "StringDecryptionBB", Func, C);
-    // Change A's terminator to jump to B
-    // We'll add new terminator to jump C later
-    BranchInst *newBr = BranchInst::Create(B);
-    ReplaceInstWithInst(A->getTerminator(), newBr);
-    // Insert DecryptionCode
-    HandleDecryptionBlock(B, C, GV2Keys);
-    IRBuilder<> IRB(A->getFirstNonPHIOrDbgOrLifetime());
-    // Add atomic load checking status in A
-    LoadInst *LI = IRB.CreateLoad(StatusGV->getValueType(), StatusGV,
-                                  "LoadEncryptionStatus");
-    LI->setAtomic(
-        AtomicOrdering::Acquire); // Will be released at the start of C
+    HandleDecryptionBlock(B, C, Keys);
+    IRBuilder<> IRB(A->getTerminator());
+    LoadInst *LI = IRB.CreateLoad(Int32Ty, StatusGV, "LoadEncryptionStatus");
+    LI->setAtomic(AtomicOrdering::Acquire);
     LI->setAlignment(Align(4));
-    Value *condition = IRB.CreateICmpEQ(
-        LI, ConstantInt::get(Type::getInt32Ty(Func->getContext()), 0));
+    IRB.CreateCondBr(IRB.CreateICmpEQ(LI, ConstantInt::get(Int32Ty, 2)), C, L);
     A->getTerminator()->eraseFromParent();
-    BranchInst::Create(B, C, condition, A);
-    // Add StoreInst atomically in C start
-    // No matter control flow is coming from A or B, the GVs must be decrypted
-    StoreInst *SI =
-        new StoreInst(ConstantInt::get(Type::getInt32Ty(Func->getContext()), 1),
-                      StatusGV, C->getFirstNonPHIOrDbgOrLifetime());
-    SI->setAlignment(Align(4));
-    SI->setAtomic(AtomicOrdering::Release); // Release the lock acquired in LI
-  }                                         // End of HandleFunction
+    IRB.SetInsertPoint(L);
+    IRB.CreateCondBr(IRB.CreateCall(getLockRoutine(Func->getParent()),
+                                    {StatusGV}),
+                     B, C);
+    CallInst::Create(getUnlockRoutine(Func->getParent()), {StatusGV}, "",
+                     B->getTerminator());
+  }
+
+  // Split the block of P in front of it, static allocas of the entry block
+  // stay in it
+  static BasicBlock *splitBlockBefore(Instruction *P) {
+    BasicBlock *A = P->getParent();
+    if (A->isEntryBlock()) {
+      while (isa<AllocaInst>(P) && cast<AllocaInst>(P)->isStaticAlloca())
+        P = P->getNextNode();
+      for (Instruction &I : make_early_inc_range(*A))
+        if (AllocaInst *AI = dyn_cast<AllocaInst>(&I))
+          if (AI->isStaticAlloca() && P->comesBefore(AI))
+            AI->moveBefore(P);
+    }
+    return A->splitBasicBlock(P);
+  }
+
+  // Runtime support of the decryption, kept out of reach of the other passes
+  // so that it stays fast
+  Function *createRuntimeFunction(Module *M, FunctionType *FTy,
+                                  StringRef Name) {
+    Function *F = Function::Create(
+        FTy, GlobalValue::LinkageTypes::PrivateLinkage, Name, M);
+    F->addFnAttr(Attribute::NoUnwind);
+    writeAnnotate(F, "nostrenc nosplit nobcf nofla nosub noconstenc noindibr");
+    return F;
+  }
+
+  // SYS_futex of the target or 0 if we can't sleep on the status
+  static uint64_t getFutexSyscall(const Triple &T) {
+    if (!T.isOSLinux())
+      return 0;
+    switch (T.getArch()) {
+    case Triple::x86_64:
+      return T.getEnvironment() == Triple::GNUX32 ? 0 : 202;
+    case Triple::x86:
+    case Triple::arm:
+    case Triple::thumb:
+      return 240;
+    case Triple::aarch64:
+    case Triple::riscv64:
+      return 98;
+    default:
+      return 0;
+    }
+  }
+
+  // SYS_membarrier of the Linux targets -strcry_trampoline needs it on, else 0
+  static uint64_t getMembarrierSyscall(const Triple &T) {
+    if (!T.isOSLinux())
+      return 0;
+    switch (T.getArch()) {
+    case Triple::arm:
+    case Triple::thumb:
+      return 389;
+    case Triple::aarch64:
+    case Triple::riscv64:
+      return 283;
+    default:
+      return 0;
+    }
+  }
+
+  /* getLockRoutine
+   *
+   * i1 HikariStringDecryptionLock(i32 *status)
+   * Returns true if the caller changed the status from 0 to 1 and has to
+   * decrypt. Otherwise spins until the status is 2 and returns false, after
+   * a while waiting on a futex on Linux or yielding elsewhere.
+   */
+  Function *getLockRoutine(Module *M) {
+    if (lockroutine)
+      return lockroutine;
+    LLVMContext &C = M->getContext();
+    Triple T(M->getTargetTriple());
+    Type *Int32Ty = Type::getInt32Ty(C);
+    Type *LongTy = M->getDataLayout().getIntPtrType(C);
+    Function *F = createRuntimeFunction(
+        M,
+        FunctionType::get(Type::getInt1Ty(C), {Type::getInt32PtrTy(C)}, false),
+        "HikariStringDecryptionLock");
+    Value *Status = F->getArg(0);
+    BasicBlock *Entry = BasicBlock::Create(C, "", F);
+    BasicBlock *Wait = BasicBlock::Create(C, "", F);
+    BasicBlock *Check = BasicBlock::Create(C, "", F);
+    BasicBlock *Spin = BasicBlock::Create(C, "", F);
+    BasicBlock *Sleep = BasicBlock::Create(C, "", F);
+    BasicBlock *Done = BasicBlock::Create(C, "", F);
+    IRBuilder<> IRB(Entry);
+    Value *Acquired = IRB.CreateExtractValue(
+        IRB.CreateAtomicCmpXchg(Status, ConstantInt::get(Int32Ty, 0),
+                                ConstantInt::get(Int32Ty, 1), MaybeAlign(4),
+                                AtomicOrdering::Acquire,
+                                AtomicOrdering::Acquire),
+        1);
+    IRB.CreateCondBr(Acquired, Done, Wait);
+    IRB.SetInsertPoint(Wait);
+    PHINode *Spins = IRB.CreatePHI(Int32Ty, 3);
+    Spins->addIncoming(ConstantInt::get(Int32Ty, 0), Entry);
+    LoadInst *LI = IRB.CreateLoad(Int32Ty, Status);
+    LI->setAtomic(AtomicOrdering::Acquire);
+    LI->setAlignment(Align(4));
+    IRB.CreateCondBr(IRB.CreateICmpEQ(LI, ConstantInt::get(Int32Ty, 2)), Done,
+                     Check);
+    IRB.SetInsertPoint(Check);
+    IRB.CreateCondBr(IRB.CreateICmpULT(Spins, ConstantInt::get(Int32Ty, 100)),
+                     Spin, Sleep);
+    IRB.SetInsertPoint(Spin);
+    if (T.getArch() == Triple::x86_64)
+      IRB.CreateCall(Intrinsic::getDeclaration(M, Intrinsic::x86_sse2_pause));
+    else if (T.isAArch64())
+      IRB.CreateCall(Intrinsic::getDeclaration(M, Intrinsic::aarch64_hint),
+                     {ConstantInt::get(Int32Ty, 1)}); // yield
+    Spins->addIncoming(IRB.CreateAdd(Spins, ConstantInt::get(Int32Ty, 1)),
+                       Spin);
+    IRB.CreateBr(Wait);
+    IRB.SetInsertPoint(Sleep);
+    if (uint64_t SysFutex = getFutexSyscall(T)) {
+      // Announce the waiter, then sleep unless the status changed meanwhile
+      IRB.CreateAtomicCmpXchg(Status, ConstantInt::get(Int32Ty, 1),
+                              ConstantInt::get(Int32Ty, 3), MaybeAlign(4),
+                              AtomicOrdering::Monotonic,
+                              AtomicOrdering::Monotonic);
+      FunctionCallee Syscall = M->getOrInsertFunction(
+          "syscall", FunctionType::get(LongTy, {LongTy}, true));
+      IRB.CreateCall(Syscall, {ConstantInt::get(LongTy, SysFutex),
+                               IRB.CreatePtrToInt(Status, LongTy),
+                               ConstantInt::get(LongTy, 128), // WAIT_PRIVATE
+                               ConstantInt::get(LongTy, 3),
+                               ConstantInt::get(LongTy, 0)});
+    } else if (T.isOSWindows())
+      IRB.CreateCall(M->getOrInsertFunction("SwitchToThread", Int32Ty));
+    else if (T.getOS() != Triple::UnknownOS)
+      IRB.CreateCall(M->getOrInsertFunction("sched_yield", Int32Ty));
+    Spins->addIncoming(Spins, Sleep);
+    IRB.CreateBr(Wait);
+    IRB.SetInsertPoint(Done);
+    IRB.CreateRet(Acquired);
+    lockroutine = F;
+    return F;
+  }
+
+  /* getUnlockRoutine
+   *
+   * void HikariStringDecryptionUnlock(i32 *status)
+   * Publishes the decrypted strings with status 2 and wakes the threads
+   * sleeping in HikariStringDecryptionLock.
+   */
+  Function *getUnlockRoutine(Module *M) {
+    if (unlockroutine)
+      return unlockroutine;
+    LLVMContext &C = M->getContext();
+    Triple T(M->getTargetTriple());
+    Type *Int32Ty = Type::getInt32Ty(C);
+    Type *LongTy = M->getDataLayout().getIntPtrType(C);
+    Function *F = createRuntimeFunction(
+        M,
+        FunctionType::get(Type::getVoidTy(C), {Type::getInt32PtrTy(C)}, false),
+        "HikariStringDecryptionUnlock");
+    Value *Status = F->getArg(0);
+    BasicBlock *Entry = BasicBlock::Create(C, "", F);
+    BasicBlock *Exit = BasicBlock::Create(C, "", F);
+    IRBuilder<> IRB(Entry);
+    Value *Old = IRB.CreateAtomicRMW(AtomicRMWInst::Xchg, Status,
+                                     ConstantInt::get(Int32Ty, 2),
+                                     MaybeAlign(4), AtomicOrdering::Release);
+    if (uint64_t SysFutex = getFutexSyscall(T)) {
+      BasicBlock *Wake = BasicBlock::Create(C, "", F, Exit);
+      IRB.CreateCondBr(IRB.CreateICmpEQ(Old, ConstantInt::get(Int32Ty, 3)),
+                       Wake, Exit);
+      IRB.SetInsertPoint(Wake);
+      FunctionCallee Syscall = M->getOrInsertFunction(
+          "syscall", FunctionType::get(LongTy, {LongTy}, true));
+      IRB.CreateCall(Syscall, {ConstantInt::get(LongTy, SysFutex),
+                               IRB.CreatePtrToInt(Status, LongTy),
+                               ConstantInt::get(LongTy, 129), // WAKE_PRIVATE
+                               ConstantInt::get(LongTy, INT32_MAX)});
+    }
+    IRB.CreateBr(Exit);
+    ReturnInst::Create(C, Exit);
+    unlockroutine = F;
+    return F;
+  }
 
   GlobalVariable *ObjectiveCString(GlobalVariable *GV, std::string name,
                                    GlobalVariable *newString,
@@ -495,21 +2326,83 @@ struct StringEncryption : public ModulePass {
              GV2Keys.begin();
          iter != GV2Keys.end(); ++iter) {
       Constant *KeyConst = iter->second.first;
-      ConstantDataArray *CastedCDA = cast<ConstantDataArray>(KeyConst);
       // Prevent optimization of encrypted data
       appendToCompilerUsed(*iter->second.second->getParent(),
                            {iter->second.second});
+      Module *M = B->getModule();
+      Type *Int8PtrTy = Type::getInt8PtrTy(B->getContext());
+      Value *Len = ConstantInt::get(
+          Type::getInt64Ty(B->getContext()),
+          M->getDataLayout().getTypeAllocSize(iter->first->getValueType()));
+      std::map<GlobalVariable *, GlobalVariable *>::iterator Chunks =
+          chunkstatus.find(iter->first);
+      if (Chunks != chunkstatus.end()) {
+        IRB.CreateCall(
+            getChunkRoutine(M),
+            {IRB.CreatePointerCast(iter->first, Int8PtrTy),
+             IRB.CreatePointerCast(iter->second.second, Int8PtrTy), Len,
+             KeyConst,
+             IRB.CreatePointerCast(Chunks->second,
+                                   Type::getInt32PtrTy(B->getContext())),
+             ConstantInt::get(Type::getInt64Ty(B->getContext()), 0), Len});
+        continue;
+      }
+      if (compressedstrings.count(iter->first)) {
+        IRB.CreateCall(getDecompressionRoutine(M),
+                       {IRB.CreatePointerCast(iter->first, Int8PtrTy),
+                        IRB.CreatePointerCast(iter->second.second, Int8PtrTy),
+                        Len, KeyConst});
+        continue;
+      }
+      // In place the encrypted string is the decrypt space and left out
+      auto DecryptionArgs = [&]() {
+        std::vector<Value *> Args = {
+            IRB.CreatePointerCast(iter->first, Int8PtrTy)};
+        if (!InPlace)
+          Args.emplace_back(
+              IRB.CreatePointerCast(iter->second.second, Int8PtrTy));
+        return Args;
+      };
+      if (ConstantDataVector *Nonce = dyn_cast<ConstantDataVector>(KeyConst)) {
+        std::vector<Value *> Args = DecryptionArgs();
+        Args.insert(Args.end(),
+                    {Len,
+                     IRB.CreatePointerCast(
+                         getChaChaKey(M),
+                         Type::getInt32PtrTy(B->getContext())),
+                     Nonce->getElementAsConstant(0),
+                     Nonce->getElementAsConstant(1),
+                     Nonce->getElementAsConstant(2)});
+        IRB.CreateCall(getChaChaRoutine(M), Args);
+        continue;
+      }
+      if (isa<ConstantInt>(KeyConst)) {
+        std::vector<Value *> Args = DecryptionArgs();
+        Args.insert(Args.end(), {Len, KeyConst});
+        IRB.CreateCall(getKeystreamRoutine(M, InPlace), Args);
+        continue;
+      }
+      std::map<GlobalVariable *, GlobalVariable *>::iterator KeyGV =
+          decryptionkeys.find(iter->first);
+      if (KeyGV != decryptionkeys.end()) {
+        std::vector<Value *> Args = DecryptionArgs();
+        Args.insert(Args.end(),
+                    {IRB.CreatePointerCast(KeyGV->second, Int8PtrTy), Len});
+        IRB.CreateCall(getDecryptionRoutine(M), Args);
+        continue;
+      }
+      ConstantDataArray *CastedCDA = cast<ConstantDataArray>(KeyConst);
+      std::map<GlobalVariable *, BitVector>::iterator Unencrypted =
+          unencryptedindex.find(iter->first);
       // Element-By-Element XOR so the fucking verifier won't complain
       // Also, this hides keys
       uint64_t realkeyoff = 0;
       for (uint64_t i = 0; i < CastedCDA->getType()->getNumElements(); i++) {
-        if (unencryptedindex[KeyConst].size() &&
-            std::find(unencryptedindex[KeyConst].begin(),
-                      unencryptedindex[KeyConst].end(),
-                      i) != unencryptedindex[KeyConst].end())
+        if (Unencrypted != unencryptedindex.end() &&
+            Unencrypted->second.test(i))
           continue;
-        Value *offset =
-            ConstantInt::get(Type::getInt64Ty(B->getContext()), realkeyoff);
+        Value *offset = ConstantInt::get(Type::getInt64Ty(B->getContext()),
+                                         InPlace ? i : realkeyoff);
         Value *offset2 = ConstantInt::get(Type::getInt64Ty(B->getContext()), i);
         Value *EncryptedGEP =
             IRB.CreateGEP(iter->second.second->getValueType(),
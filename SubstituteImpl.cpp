@@ -1,530 +1,912 @@
 //===----------------------------------------------------------------------===//
 
 #include "llvm/Transforms/Obfuscation/SubstituteImpl.h"
+#include "SubstituteImplInternal.h"
+#include "llvm/ADT/SetVector.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/NoFolder.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/Obfuscation/CryptoUtils.h"
 
 using namespace llvm;
-
-#define NUMBER_ADD_SUBST 7
-#define NUMBER_SUB_SUBST 6
-#define NUMBER_AND_SUBST 6
-#define NUMBER_OR_SUBST 6
-#define NUMBER_XOR_SUBST 6
-#define NUMBER_MUL_SUBST 2
-
-static void addNeg(BinaryOperator *bo);
-static void addDoubleNeg(BinaryOperator *bo);
-static void addRand(BinaryOperator *bo);
-static void addRand2(BinaryOperator *bo);
-static void addSubstitution(BinaryOperator *bo);
-static void addSubstitution2(BinaryOperator *bo);
-static void addSubstitution3(BinaryOperator *bo);
-
-static void subNeg(BinaryOperator *bo);
-static void subRand(BinaryOperator *bo);
-static void subRand2(BinaryOperator *bo);
-static void subSubstitution(BinaryOperator *bo);
-static void subSubstitution2(BinaryOperator *bo);
-static void subSubstitution3(BinaryOperator *bo);
-
-static void andSubstitution(BinaryOperator *bo);
-static void andSubstitution2(BinaryOperator *bo);
-static void andSubstitution3(BinaryOperator *bo);
-static void andSubstitutionRand(BinaryOperator *bo);
-static void andNor(BinaryOperator *bo);
-static void andNand(BinaryOperator *bo);
-
-static void orSubstitution(BinaryOperator *bo);
-static void orSubstitution2(BinaryOperator *bo);
-static void orSubstitution3(BinaryOperator *bo);
-static void orSubstitutionRand(BinaryOperator *bo);
-static void orNor(BinaryOperator *bo);
-static void orNand(BinaryOperator *bo);
-
-static void xorSubstitution(BinaryOperator *bo);
-static void xorSubstitution2(BinaryOperator *bo);
-static void xorSubstitution3(BinaryOperator *bo);
-static void xorSubstitutionRand(BinaryOperator *bo);
-static void xorNor(BinaryOperator *bo);
-static void xorNand(BinaryOperator *bo);
-
-static void mulSubstitution(BinaryOperator *bo);
-static void mulSubstitution2(BinaryOperator *bo);
-
-static void (*funcAdd[NUMBER_ADD_SUBST])(BinaryOperator *bo) = {
-    &addNeg,          &addDoubleNeg,     &addRand,         &addRand2,
-    &addSubstitution, &addSubstitution2, &addSubstitution3};
-static void (*funcSub[NUMBER_SUB_SUBST])(BinaryOperator *bo) = {
-    &subNeg,          &subRand,          &subRand2,
-    &subSubstitution, &subSubstitution2, &subSubstitution3};
-static void (*funcAnd[NUMBER_AND_SUBST])(BinaryOperator *bo) = {
-    &andSubstitution,     &andSubstitution2, &andSubstitution3,
-    &andSubstitutionRand, &andNor,           &andNand};
-static void (*funcOr[NUMBER_OR_SUBST])(BinaryOperator *bo) = {
-    &orSubstitution,     &orSubstitution2, &orSubstitution3,
-    &orSubstitutionRand, &orNor,           &orNand};
-static void (*funcXor[NUMBER_XOR_SUBST])(BinaryOperator *bo) = {
-    &xorSubstitution,     &xorSubstitution2, xorSubstitution3,
-    &xorSubstitutionRand, &xorNor,           &xorNand};
-static void (*funcMul[NUMBER_MUL_SUBST])(BinaryOperator *bo) = {
-    &mulSubstitution, &mulSubstitution2};
-
-void SubstituteImpl::substituteAdd(BinaryOperator *bo) {
-  (*funcAdd[cryptoutils->get_range(NUMBER_ADD_SUBST)])(bo);
-}
-void SubstituteImpl::substituteSub(BinaryOperator *bo) {
-  (*funcSub[cryptoutils->get_range(NUMBER_SUB_SUBST)])(bo);
-}
-void SubstituteImpl::substituteAnd(BinaryOperator *bo) {
-  (*funcAnd[cryptoutils->get_range(NUMBER_AND_SUBST)])(bo);
-}
-void SubstituteImpl::substituteOr(BinaryOperator *bo) {
-  (*funcOr[cryptoutils->get_range(NUMBER_OR_SUBST)])(bo);
-}
-void SubstituteImpl::substituteXor(BinaryOperator *bo) {
-  (*funcXor[cryptoutils->get_range(NUMBER_XOR_SUBST)])(bo);
-}
-void SubstituteImpl::substituteMul(BinaryOperator *bo) {
-  (*funcMul[cryptoutils->get_range(NUMBER_MUL_SUBST)])(bo);
+using namespace llvm::PatternMatch;
+
+static cl::opt<uint32_t> MBATerms(
+    "sub_mba_terms",
+    cl::desc("Replace add, sub, and, or and xor with one generated linear "
+             "Mixed Boolean-Arithmetic expression of about this many terms "
+             "(at least 4) instead of the fixed substitutions. 0 disables"),
+    cl::value_desc("number of terms"), cl::init(0), cl::Optional);
+static cl::opt<bool> Interleave(
+    "sub_interleave",
+    cl::desc("Spread the instructions of every substitution over the "
+             "independent instructions before it instead of emitting one "
+             "dependent chain right before the substituted instruction"),
+    cl::init(false), cl::Optional);
+
+static bool substituteLinearMBA(BinaryOperator *bo);
+
+// Rewrite rules are postfix programs over the operands of the substituted
+// instruction, see SubstitutionRules.def
+namespace subst {
+// Operands, unary and binary operations, in this order
+enum Token : uint8_t {
+  X,
+  Y,
+  C1,
+  C2,
+  R,
+  Not,
+  Neg,
+  Add,
+  Sub,
+  And,
+  Or,
+  Xor,
+  Mul,
+  Nor,
+  Nand
+};
+static constexpr unsigned MaxDepth = 8;
+
+#define SUBST_RULE(OPCODE, NAME, PATTERN, ...)                                 \
+  static constexpr Token NAME[] = {__VA_ARGS__};
+#include "SubstitutionRules.def"
+} // namespace subst
+
+// Number of add/sub, bitwise and mul instructions a rule emits, used to
+// estimate its cost, and whether it uses a random constant. Nor/Nand count
+// with their larger form.
+struct SubstitutionOps {
+  uint8_t AddSub, Logic, Mul;
+  bool Rand;
+};
+struct SubstitutionRule {
+  unsigned Opcode;
+  const char *Name;
+  const char *Pattern;
+  const subst::Token *Program;
+  size_t Size;
+  SubstitutionOps Ops;
+};
+
+template <size_t N>
+static constexpr size_t programSize(const subst::Token (&)[N]) {
+  return N;
+}
+
+template <size_t N>
+static constexpr SubstitutionOps countOps(const subst::Token (&Program)[N]) {
+  SubstitutionOps Ops = {0, 0, 0, false};
+  for (subst::Token T : Program)
+    switch (T) {
+    case subst::R:
+      Ops.Rand = true;
+      break;
+    case subst::Neg:
+    case subst::Add:
+    case subst::Sub:
+      Ops.AddSub++;
+      break;
+    case subst::Not:
+    case subst::And:
+    case subst::Or:
+    case subst::Xor:
+      Ops.Logic++;
+      break;
+    case subst::Nor:
+    case subst::Nand:
+      Ops.Logic += 3;
+      break;
+    case subst::Mul:
+      Ops.Mul++;
+      break;
+    default:
+      break;
+    }
+  return Ops;
+}
+
+// The program must leave exactly one value on a stack of at most MaxDepth
+template <size_t N>
+static constexpr bool isWellFormed(const subst::Token (&Program)[N]) {
+  unsigned Depth = 0;
+  for (subst::Token T : Program) {
+    if (T <= subst::R) {
+      if (++Depth > subst::MaxDepth)
+        return false;
+    } else if (T > subst::Neg) {
+      if (Depth-- < 2)
+        return false;
+    } else if (!Depth)
+      return false;
+  }
+  return Depth == 1;
+}
+
+static constexpr uint64_t evaluateRule(const subst::Token *Program,
+                                       size_t Size, uint64_t x, uint64_t y,
+                                       uint64_t r, uint64_t Mask) {
+  uint64_t Stack[subst::MaxDepth] = {};
+  unsigned Depth = 0;
+  for (size_t i = 0; i < Size; i++) {
+    subst::Token T = Program[i];
+    if (T <= subst::R) {
+      Stack[Depth++] = T == subst::X    ? x
+                       : T == subst::Y  ? y
+                       : T == subst::C1 ? 1
+                       : T == subst::C2 ? 2
+                                        : r;
+      continue;
+    }
+    uint64_t &a = Stack[T > subst::Neg ? Depth - 2 : Depth - 1];
+    uint64_t b = Stack[Depth - 1];
+    switch (T) {
+    case subst::Not:
+      a = ~a;
+      break;
+    case subst::Neg:
+      a = 0 - a;
+      break;
+    case subst::Add:
+      a += b;
+      break;
+    case subst::Sub:
+      a -= b;
+      break;
+    case subst::And:
+      a &= b;
+      break;
+    case subst::Or:
+      a |= b;
+      break;
+    case subst::Xor:
+      a ^= b;
+      break;
+    case subst::Mul:
+      a *= b;
+      break;
+    case subst::Nor:
+      a = ~(a | b);
+      break;
+    case subst::Nand:
+      a = ~(a & b);
+      break;
+    default:
+      break;
+    }
+    a &= Mask;
+    if (T > subst::Neg)
+      Depth--;
+  }
+  return Stack[0] & Mask;
+}
+
+static constexpr uint64_t evaluateOpcode(unsigned Opcode, uint64_t x,
+                                         uint64_t y, uint64_t Mask) {
+  return (Opcode == Instruction::Add   ? x + y
+          : Opcode == Instruction::Sub ? x - y
+          : Opcode == Instruction::And ? x & y
+          : Opcode == Instruction::Or  ? x | y
+          : Opcode == Instruction::Xor ? x ^ y
+                                       : x * y) &
+         Mask;
+}
+
+// Exhaustive over all operands of BitWidth bits and a few random constants
+static constexpr bool isIdentity(unsigned Opcode, const subst::Token *Program,
+                                 size_t Size, unsigned BitWidth) {
+  uint64_t Mask = (uint64_t(1) << BitWidth) - 1;
+  for (uint64_t x = 0; x <= Mask; x++)
+    for (uint64_t y = 0; y <= Mask; y++)
+      for (uint64_t r : {uint64_t(0), uint64_t(0x5a), Mask})
+        if (evaluateRule(Program, Size, x, y, r & Mask, Mask) !=
+            evaluateOpcode(Opcode, x, y, Mask))
+          return false;
+  return true;
+}
+
+// 4-bit operands keep the check within the constant evaluation limits of the
+// compilers, EXPENSIVE_CHECKS builds repeat it on 8 bits before first use
+#define SUBST_RULE(OPCODE, NAME, PATTERN, ...)                                 \
+  static_assert(isWellFormed(subst::NAME), #NAME " is not a valid program");   \
+  static_assert(isIdentity(Instruction::OPCODE, subst::NAME,                   \
+                           programSize(subst::NAME), 4),                       \
+                #NAME " is not equal to " #OPCODE);
+#include "SubstitutionRules.def"
+
+static constexpr SubstitutionRule Rules[] = {
+#define SUBST_RULE(OPCODE, NAME, PATTERN, ...)                                 \
+  {Instruction::OPCODE,       #NAME, PATTERN, subst::NAME,                    \
+   programSize(subst::NAME), countOps(subst::NAME)},
+#include "SubstitutionRules.def"
+};
+
+#ifdef EXPENSIVE_CHECKS
+static bool verifyRules() {
+  for (const SubstitutionRule &Rule : Rules)
+    if (!isIdentity(Rule.Opcode, Rule.Program, Rule.Size, 8))
+      report_fatal_error(Twine("Substitution rule ") + Rule.Name + " (" +
+                         Rule.Pattern + ") is not an identity on 8 bits");
+  return true;
+}
+#endif
+
+// Rough size of a generated linear MBA term: a * e(x, y) + ...
+static const SubstitutionOps opsMBATerm = {1, 2, 1, false};
+
+// Lane-wise rewrites that stay cheap on SSE/AVX2/NEON: no vector multiply,
+// which is slow or missing for wide elements, no constant pool splat and no
+// long Nor/Nand chains
+static bool isVectorFriendly(const SubstitutionOps &Ops) {
+  return !Ops.Mul && !Ops.Rand && Ops.AddSub + Ops.Logic <= 5;
+}
+
+static ArrayRef<SubstitutionRule> getSubstitutions(unsigned Opcode) {
+#ifdef EXPENSIVE_CHECKS
+  static const bool Verified = verifyRules();
+  (void)Verified;
+#endif
+  const SubstitutionRule *Begin = std::begin(Rules), *End = std::end(Rules);
+  while (Begin != End && Begin->Opcode != Opcode)
+    Begin++;
+  const SubstitutionRule *Last = Begin;
+  while (Last != End && Last->Opcode == Opcode)
+    Last++;
+  return makeArrayRef(Begin, Last);
+}
+
+// Instructions inserted before End since Prev was the one before it
+static SmallVector<Instruction *, 16> getInserted(Instruction *Prev,
+                                                  Instruction *End) {
+  SmallVector<Instruction *, 16> Seq;
+  for (Instruction *I = Prev ? Prev->getNextNode() : &End->getParent()->front();
+       I != End; I = I->getNextNode())
+    Seq.push_back(I);
+  return Seq;
+}
+
+// Spread Seq, which only depends on itself and on values defined before it,
+// evenly over the independent instructions right before it, so that an
+// out-of-order core can overlap its latency with theirs
+static void interleaveInserted(ArrayRef<Instruction *> Seq) {
+  if (!Interleave || Seq.empty())
+    return;
+  SmallPtrSet<Value *, 16> Needed;
+  for (Instruction *I : Seq)
+    Needed.insert(I->op_begin(), I->op_end());
+  // Bounded to keep the values of Seq from living across the whole block
+  SmallVector<Instruction *, 64> Window;
+  for (Instruction *I = Seq.front()->getPrevNode();
+       I && Window.size() < 4 * Seq.size() && !Needed.count(I) &&
+       !isa<PHINode>(I) && !isa<AllocaInst>(I) && !I->isEHPad();
+       I = I->getPrevNode())
+    Window.push_back(I);
+  std::reverse(Window.begin(), Window.end());
+  if (!Window.empty())
+    for (size_t k = 0; k < Seq.size(); k++)
+      Seq[k]->moveBefore(Window[k * Window.size() / Seq.size()]);
 }
 
 // Implementation of ~(a | b) and ~a & ~b
-static BinaryOperator *buildNor(Value *a, Value *b, Instruction *insertBefore) {
-  switch (cryptoutils->get_range(2)) {
-  case 0: {
-    // ~(a | b)
-    BinaryOperator *op =
-        BinaryOperator::Create(Instruction::Or, a, b, "", insertBefore);
-    op = BinaryOperator::CreateNot(op, "", insertBefore);
-    return op;
-  }
-  case 1: {
-    // ~a & ~b
-    BinaryOperator *nota = BinaryOperator::CreateNot(a, "", insertBefore);
-    BinaryOperator *notb = BinaryOperator::CreateNot(b, "", insertBefore);
-    BinaryOperator *op =
-        BinaryOperator::Create(Instruction::And, nota, notb, "", insertBefore);
-    return op;
-  }
-  default:
-    llvm_unreachable("wtf?");
-  }
+static Value *buildNor(Value *a, Value *b, IRBuilder<NoFolder> &IRB) {
+  if (cryptoutils->get_range(2))
+    return IRB.CreateNot(IRB.CreateOr(a, b));
+  return IRB.CreateAnd(IRB.CreateNot(a), IRB.CreateNot(b));
 }
 
 // Implementation of ~(a & b) and ~a | ~b
-static BinaryOperator *buildNand(Value *a, Value *b,
-                                 Instruction *insertBefore) {
-  switch (cryptoutils->get_range(2)) {
-  case 0: {
-    // ~(a & b)
-    BinaryOperator *op =
-        BinaryOperator::Create(Instruction::And, a, b, "", insertBefore);
-    op = BinaryOperator::CreateNot(op, "", insertBefore);
-    return op;
+static Value *buildNand(Value *a, Value *b, IRBuilder<NoFolder> &IRB) {
+  if (cryptoutils->get_range(2))
+    return IRB.CreateNot(IRB.CreateAnd(a, b));
+  return IRB.CreateOr(IRB.CreateNot(a), IRB.CreateNot(b));
+}
+
+static void applyRule(const SubstitutionRule &Rule, BinaryOperator *bo) {
+  Instruction *Prev = bo->getPrevNode();
+  IRBuilder<NoFolder> IRB(bo);
+  Type *Ty = bo->getType();
+  Constant *r =
+      Rule.Ops.Rand ? ConstantInt::get(Ty, cryptoutils->get_uint64_t())
+                    : nullptr;
+  SmallVector<Value *, subst::MaxDepth> Stack;
+  for (const subst::Token *T = Rule.Program; T != Rule.Program + Rule.Size;
+       T++) {
+    switch (*T) {
+    case subst::X:
+      Stack.push_back(bo->getOperand(0));
+      continue;
+    case subst::Y:
+      Stack.push_back(bo->getOperand(1));
+      continue;
+    case subst::C1:
+      Stack.push_back(ConstantInt::get(Ty, 1));
+      continue;
+    case subst::C2:
+      Stack.push_back(ConstantInt::get(Ty, 2));
+      continue;
+    case subst::R:
+      Stack.push_back(r);
+      continue;
+    case subst::Not:
+      Stack.back() = IRB.CreateNot(Stack.back());
+      continue;
+    case subst::Neg:
+      Stack.back() = IRB.CreateNeg(Stack.back());
+      continue;
+    default:
+      break;
+    }
+    Value *b = Stack.pop_back_val();
+    Value *&a = Stack.back();
+    switch (*T) {
+    case subst::Add:
+      a = IRB.CreateAdd(a, b);
+      break;
+    case subst::Sub:
+      a = IRB.CreateSub(a, b);
+      break;
+    case subst::And:
+      a = IRB.CreateAnd(a, b);
+      break;
+    case subst::Or:
+      a = IRB.CreateOr(a, b);
+      break;
+    case subst::Xor:
+      a = IRB.CreateXor(a, b);
+      break;
+    case subst::Mul:
+      a = IRB.CreateMul(a, b);
+      break;
+    case subst::Nor:
+      a = buildNor(a, b, IRB);
+      break;
+    case subst::Nand:
+      a = buildNand(a, b, IRB);
+      break;
+    default:
+      llvm_unreachable("Unknown substitution token");
+    }
   }
-  case 1: {
-    // ~a | ~b
-    BinaryOperator *nota = BinaryOperator::CreateNot(a, "", insertBefore);
-    BinaryOperator *notb = BinaryOperator::CreateNot(b, "", insertBefore);
-    BinaryOperator *op =
-        BinaryOperator::Create(Instruction::Or, nota, notb, "", insertBefore);
-    return op;
+  bo->replaceAllUsesWith(Stack.back());
+  interleaveInserted(getInserted(Prev, bo));
+}
+
+static void applyRandomRule(BinaryOperator *bo) {
+  ArrayRef<SubstitutionRule> Rules = getSubstitutions(bo->getOpcode());
+  applyRule(Rules[cryptoutils->get_range(Rules.size())], bo);
+}
+
+static InstructionCost substitutionCost(const SubstitutionOps &Ops, Type *Ty,
+                                        const TargetTransformInfo &TTI,
+                                        unsigned Times = 1) {
+  TargetTransformInfo::TargetCostKind CostKind =
+      TargetTransformInfo::TCK_Latency;
+  return (TTI.getArithmeticInstrCost(Instruction::Add, Ty, CostKind) *
+              Ops.AddSub +
+          TTI.getArithmeticInstrCost(Instruction::Xor, Ty, CostKind) *
+              Ops.Logic +
+          TTI.getArithmeticInstrCost(Instruction::Mul, Ty, CostKind) *
+              Ops.Mul) *
+         Times;
+}
+
+bool SubstituteImpl::substituteVectorFriendly(BinaryOperator *bo) {
+  std::vector<const SubstitutionRule *> candidates;
+  for (const SubstitutionRule &Rule : getSubstitutions(bo->getOpcode()))
+    if (isVectorFriendly(Rule.Ops))
+      candidates.emplace_back(&Rule);
+  if (candidates.empty())
+    return false;
+  applyRule(*candidates[cryptoutils->get_range(candidates.size())], bo);
+  return true;
+}
+
+bool SubstituteImpl::substituteWithinBudget(BinaryOperator *bo,
+                                            const TargetTransformInfo &TTI,
+                                            uint64_t Weight,
+                                            InstructionCost &Budget,
+                                            bool PreferCheap,
+                                            bool VectorFriendly) {
+  ArrayRef<SubstitutionRule> Rules = getSubstitutions(bo->getOpcode());
+  if (Rules.empty())
+    return false;
+  Type *Ty = bo->getType();
+  InstructionCost Base = TTI.getArithmeticInstrCost(
+      bo->getOpcode(), Ty, TargetTransformInfo::TCK_Latency);
+  // With -sub_mba_terms the generated expression is the only candidate
+  bool UseMBA = MBATerms && bo->getOpcode() != Instruction::Mul &&
+                Ty->getScalarSizeInBits() <= 64 && !VectorFriendly;
+  std::vector<std::pair<unsigned /*index*/, InstructionCost /*cost*/>> fits;
+  for (unsigned i = 0; i < (UseMBA ? 1 : Rules.size()); i++) {
+    if (!UseMBA && VectorFriendly && !isVectorFriendly(Rules[i].Ops))
+      continue;
+    InstructionCost Cost =
+        (UseMBA ? substitutionCost(opsMBATerm, Ty, TTI, MBATerms)
+                : substitutionCost(Rules[i].Ops, Ty, TTI)) -
+        Base;
+    // Round up so that no rewrite is free in a cold block
+    Cost = (Cost * (int64_t)std::min<uint64_t>(Weight, INT64_MAX) +
+            (int64_t)(FreqScale - 1)) /
+           (int64_t)FreqScale;
+    if (Cost.isValid() && Cost <= Budget)
+      fits.emplace_back(i, Cost);
   }
-  default:
-    llvm_unreachable("wtf?");
+  if (fits.empty())
+    return false;
+  if (PreferCheap) {
+    InstructionCost Cheapest = fits[0].second;
+    for (std::pair<unsigned, InstructionCost> &fit : fits)
+      Cheapest = std::min(Cheapest, fit.second);
+    fits.erase(std::remove_if(fits.begin(), fits.end(),
+                              [&](std::pair<unsigned, InstructionCost> &fit) {
+                                return fit.second != Cheapest;
+                              }),
+               fits.end());
   }
+  std::pair<unsigned, InstructionCost> &fit =
+      fits[cryptoutils->get_range(fits.size())];
+  if (UseMBA)
+    substituteLinearMBA(bo);
+  else
+    applyRule(Rules[fit.first], bo);
+  Budget -= fit.second;
+  return true;
 }
 
-// Implementation of a = b - (-c)
-static void addNeg(BinaryOperator *bo) {
-  BinaryOperator *op = BinaryOperator::CreateNeg(bo->getOperand(1), "", bo);
-  op = BinaryOperator::Create(Instruction::Sub, bo->getOperand(0), op, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of a = -(-b + (-c))
-static void addDoubleNeg(BinaryOperator *bo) {
-  BinaryOperator *op = BinaryOperator::CreateNeg(bo->getOperand(0), "", bo);
-  BinaryOperator *op2 = BinaryOperator::CreateNeg(bo->getOperand(1), "", bo);
-  op = BinaryOperator::Create(Instruction::Add, op, op2, "", bo);
-  op = BinaryOperator::CreateNeg(op, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of  r = rand (); a = b + r; a = a + c; a = a - r
-static void addRand(BinaryOperator *bo) {
-  ConstantInt *co = (ConstantInt *)ConstantInt::get(
-      bo->getType(), cryptoutils->get_uint64_t());
-  BinaryOperator *op =
-      BinaryOperator::Create(Instruction::Add, bo->getOperand(0), co, "", bo);
-  op = BinaryOperator::Create(Instruction::Add, op, bo->getOperand(1), "", bo);
-  op = BinaryOperator::Create(Instruction::Sub, op, co, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of r = rand (); a = b - r; a = a + b; a = a + r
-static void addRand2(BinaryOperator *bo) {
-  ConstantInt *co = (ConstantInt *)ConstantInt::get(
-      bo->getType(), cryptoutils->get_uint64_t());
-  BinaryOperator *op =
-      BinaryOperator::Create(Instruction::Sub, bo->getOperand(0), co, "", bo);
-  op = BinaryOperator::Create(Instruction::Add, op, bo->getOperand(1), "", bo);
-  op = BinaryOperator::Create(Instruction::Add, op, co, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of a = b + c => a = b - ~c - 1
-static void addSubstitution(BinaryOperator *bo) {
-  ConstantInt *co = (ConstantInt *)ConstantInt::get(bo->getType(), 1);
-  BinaryOperator *op = BinaryOperator::CreateNot(bo->getOperand(1), "", bo);
-  BinaryOperator *op1 = BinaryOperator::CreateNeg(co, "", bo);
-  op = BinaryOperator::Create(Instruction::Sub, op, op1, "", bo);
-  op = BinaryOperator::Create(Instruction::Sub, bo->getOperand(0), op, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of a = b + c => a = (b | c) + (b & c)
-static void addSubstitution2(BinaryOperator *bo) {
-  BinaryOperator *op = BinaryOperator::Create(
-      Instruction::And, bo->getOperand(0), bo->getOperand(1), "", bo);
-  BinaryOperator *op1 = BinaryOperator::Create(
-      Instruction::Or, bo->getOperand(0), bo->getOperand(1), "", bo);
-  op = BinaryOperator::Create(Instruction::Add, op, op1, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of a = b + c => a = (b ^ c) + (b & c) * 2
-static void addSubstitution3(BinaryOperator *bo) {
-  ConstantInt *co = (ConstantInt *)ConstantInt::get(bo->getType(), 2);
-  BinaryOperator *op = BinaryOperator::Create(
-      Instruction::And, bo->getOperand(0), bo->getOperand(1), "", bo);
-  op = BinaryOperator::Create(Instruction::Mul, op, co, "", bo);
-  BinaryOperator *op1 = BinaryOperator::Create(
-      Instruction::Xor, bo->getOperand(0), bo->getOperand(1), "", bo);
-  op = BinaryOperator::Create(Instruction::Add, op1, op, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of a = b + (-c)
-static void subNeg(BinaryOperator *bo) {
-  BinaryOperator *op = BinaryOperator::CreateNeg(bo->getOperand(1), "", bo);
-  op = BinaryOperator::Create(Instruction::Add, bo->getOperand(0), op, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of  r = rand (); a = b + r; a = a - c; a = a - r
-static void subRand(BinaryOperator *bo) {
-  ConstantInt *co = (ConstantInt *)ConstantInt::get(
-      bo->getType(), cryptoutils->get_uint64_t());
-  BinaryOperator *op =
-      BinaryOperator::Create(Instruction::Add, bo->getOperand(0), co, "", bo);
-  op = BinaryOperator::Create(Instruction::Sub, op, bo->getOperand(1), "", bo);
-  op = BinaryOperator::Create(Instruction::Sub, op, co, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of  r = rand (); a = b - r; a = a - c; a = a + r
-static void subRand2(BinaryOperator *bo) {
-  ConstantInt *co = (ConstantInt *)ConstantInt::get(
-      bo->getType(), cryptoutils->get_uint64_t());
-  BinaryOperator *op =
-      BinaryOperator::Create(Instruction::Sub, bo->getOperand(0), co, "", bo);
-  op = BinaryOperator::Create(Instruction::Sub, op, bo->getOperand(1), "", bo);
-  op = BinaryOperator::Create(Instruction::Add, op, co, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of a = b - c => a = (b & ~c) - (~b & c)
-static void subSubstitution(BinaryOperator *bo) {
-  BinaryOperator *op1 = BinaryOperator::CreateNot(bo->getOperand(0), "", bo);
-  BinaryOperator *op =
-      BinaryOperator::Create(Instruction::And, op1, bo->getOperand(1), "", bo);
-  op1 = BinaryOperator::CreateNot(bo->getOperand(1), "", bo);
-  BinaryOperator *op2 =
-      BinaryOperator::Create(Instruction::And, bo->getOperand(0), op1, "", bo);
-  op = BinaryOperator::Create(Instruction::Sub, op2, op, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of a = b - c => a = (2 * (b & ~c)) - (b ^ c)
-static void subSubstitution2(BinaryOperator *bo) {
-  ConstantInt *co = (ConstantInt *)ConstantInt::get(bo->getType(), 2);
-  BinaryOperator *op1 = BinaryOperator::Create(
-      Instruction::Xor, bo->getOperand(0), bo->getOperand(1), "", bo);
-  BinaryOperator *op = BinaryOperator::CreateNot(bo->getOperand(1), "", bo);
-  op = BinaryOperator::Create(Instruction::And, bo->getOperand(0), op, "", bo);
-  op = BinaryOperator::Create(Instruction::Mul, co, op, "", bo);
-  op = BinaryOperator::Create(Instruction::Sub, op, op1, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of a = b - c => a = b + ~c + 1
-static void subSubstitution3(BinaryOperator *bo) {
-  ConstantInt *co = (ConstantInt *)ConstantInt::get(bo->getType(), 1);
-  BinaryOperator *op1 = BinaryOperator::CreateNot(bo->getOperand(1), "", bo);
-  BinaryOperator *op =
-      BinaryOperator::Create(Instruction::Add, bo->getOperand(0), op1, "", bo);
-  op = BinaryOperator::Create(Instruction::Add, op, co, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of a = b & c => a = (b ^ ~c) & b
-static void andSubstitution(BinaryOperator *bo) {
-  BinaryOperator *op = BinaryOperator::CreateNot(bo->getOperand(1), "", bo);
-  BinaryOperator *op1 =
-      BinaryOperator::Create(Instruction::Xor, bo->getOperand(0), op, "", bo);
-  op = BinaryOperator::Create(Instruction::And, op1, bo->getOperand(0), "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of a = b & c => a = (b | c) & ~(b ^ c)
-static void andSubstitution2(BinaryOperator *bo) {
-  BinaryOperator *op1 = BinaryOperator::Create(
-      Instruction::Xor, bo->getOperand(0), bo->getOperand(1), "", bo);
-  op1 = BinaryOperator::CreateNot(op1, "", bo);
-  BinaryOperator *op = BinaryOperator::Create(
-      Instruction::Or, bo->getOperand(0), bo->getOperand(1), "", bo);
-  op = BinaryOperator::Create(Instruction::And, op, op1, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of a = b & c => a = (~b | c) + (b + 1)
-static void andSubstitution3(BinaryOperator *bo) {
-  ConstantInt *co = (ConstantInt *)ConstantInt::get(bo->getType(), 1);
-  BinaryOperator *op1 =
-      BinaryOperator::Create(Instruction::Add, bo->getOperand(0), co, "", bo);
-  BinaryOperator *op = BinaryOperator::CreateNot(bo->getOperand(0), "", bo);
-  op = BinaryOperator::Create(Instruction::Or, op, bo->getOperand(1), "", bo);
-  op = BinaryOperator::Create(Instruction::Add, op, op1, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of a = a & b <=> ~(~a | ~b) & (r | ~r)
-static void andSubstitutionRand(BinaryOperator *bo) {
-  ConstantInt *co = (ConstantInt *)ConstantInt::get(
-      bo->getType(), cryptoutils->get_uint64_t());
-  BinaryOperator *op = BinaryOperator::CreateNot(bo->getOperand(0), "", bo);
-  BinaryOperator *op1 = BinaryOperator::CreateNot(bo->getOperand(1), "", bo);
-  BinaryOperator *opr = BinaryOperator::CreateNot(co, "", bo);
-  BinaryOperator *opa =
-      BinaryOperator::Create(Instruction::Or, op, op1, "", bo);
-  opr = BinaryOperator::Create(Instruction::Or, co, opr, "", bo);
-  op = BinaryOperator::CreateNot(opa, "", bo);
-  op = BinaryOperator::Create(Instruction::And, op, opr, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of a = a & b => Nor(Nor(a, a), Nor(b, b))
-static void andNor(BinaryOperator *bo) {
-  BinaryOperator *noraa = buildNor(bo->getOperand(0), bo->getOperand(0), bo);
-  BinaryOperator *norbb = buildNor(bo->getOperand(1), bo->getOperand(1), bo);
-  bo->replaceAllUsesWith(buildNor(noraa, norbb, bo));
-}
-
-// Implementation of a = a & b => Nand(Nand(a, b), Nand(a, b))
-static void andNand(BinaryOperator *bo) {
-  BinaryOperator *nandab = buildNand(bo->getOperand(0), bo->getOperand(1), bo);
-  BinaryOperator *nandab2 = buildNand(bo->getOperand(0), bo->getOperand(1), bo);
-  bo->replaceAllUsesWith(buildNand(nandab, nandab2, bo));
-}
-
-// Implementation of a = a | b => a = (b & c) | (b ^ c)
-static void orSubstitution(BinaryOperator *bo) {
-  BinaryOperator *op = BinaryOperator::Create(
-      Instruction::And, bo->getOperand(0), bo->getOperand(1), "", bo);
-  BinaryOperator *op1 = BinaryOperator::Create(
-      Instruction::Xor, bo->getOperand(0), bo->getOperand(1), "", bo);
-  op = BinaryOperator::Create(Instruction::Or, op, op1, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of a = a | b => a = (b + (b ^ c)) - (b & ~c)
-static void orSubstitution2(BinaryOperator *bo) {
-  BinaryOperator *op1 = BinaryOperator::CreateNot(bo->getOperand(1), "", bo);
-  op1 =
-      BinaryOperator::Create(Instruction::And, bo->getOperand(0), op1, "", bo);
-  BinaryOperator *op = BinaryOperator::Create(
-      Instruction::Xor, bo->getOperand(0), bo->getOperand(1), "", bo);
-  op = BinaryOperator::Create(Instruction::Add, bo->getOperand(0), op, "", bo);
-  op = BinaryOperator::Create(Instruction::Sub, op, op1, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of a = a | b => a = (b + c + 1) + ~(c & b)
-static void orSubstitution3(BinaryOperator *bo) {
-  ConstantInt *co = (ConstantInt *)ConstantInt::get(bo->getType(), 1);
-  BinaryOperator *op1 = BinaryOperator::Create(
-      Instruction::And, bo->getOperand(1), bo->getOperand(0), "", bo);
-  op1 = BinaryOperator::CreateNot(op1, "", bo);
-  BinaryOperator *op = BinaryOperator::Create(
-      Instruction::Add, bo->getOperand(0), bo->getOperand(1), "", bo);
-  op = BinaryOperator::Create(Instruction::Add, op, co, "", bo);
-  op = BinaryOperator::Create(Instruction::Add, op, op1, "", bo);
-  bo->replaceAllUsesWith(op);
-}
-
-// Implementation of a = b | c => a = (((~a & r) | (a & ~r)) ^ ((~b & r) | (b &
-// ~r))) | (~(~a | ~b) & (r | ~r))
-static void orSubstitutionRand(BinaryOperator *bo) {
-  ConstantInt *co = (ConstantInt *)ConstantInt::get(
-      bo->getType(), cryptoutils->get_uint64_t());
-  BinaryOperator *op = BinaryOperator::CreateNot(bo->getOperand(0), "", bo);
-  BinaryOperator *op1 = BinaryOperator::CreateNot(bo->getOperand(1), "", bo);
-  BinaryOperator *op2 = BinaryOperator::CreateNot(co, "", bo);
-  BinaryOperator *op3 =
-      BinaryOperator::Create(Instruction::And, op, co, "", bo);
-  BinaryOperator *op4 =
-      BinaryOperator::Create(Instruction::And, bo->getOperand(0), op2, "", bo);
-  BinaryOperator *op5 =
-      BinaryOperator::Create(Instruction::And, op1, co, "", bo);
-  BinaryOperator *op6 =
-      BinaryOperator::Create(Instruction::And, bo->getOperand(1), op2, "", bo);
-  op3 = BinaryOperator::Create(Instruction::Or, op3, op4, "", bo);
-  op4 = BinaryOperator::Create(Instruction::Or, op5, op6, "", bo);
-  op5 = BinaryOperator::Create(Instruction::Xor, op3, op4, "", bo);
-  op3 = BinaryOperator::Create(Instruction::Or, op, op1, "", bo);
-  op3 = BinaryOperator::CreateNot(op3, "", bo);
-  op4 = BinaryOperator::Create(Instruction::Or, co, op2, "", bo);
-  op4 = BinaryOperator::Create(Instruction::And, op3, op4, "", bo);
-  op = BinaryOperator::Create(Instruction::Or, op5, op4, "", bo);
-  bo->replaceAllUsesWith(op);
+void SubstituteImpl::substituteAdd(BinaryOperator *bo) {
+  if (MBATerms && substituteLinearMBA(bo))
+    return;
+  applyRandomRule(bo);
 }
-
-// Implementation of a = a | b => a = Nor(Nor(a, b), Nor(a, b))
-static void orNor(BinaryOperator *bo) {
-  BinaryOperator *norab = buildNor(bo->getOperand(0), bo->getOperand(1), bo);
-  BinaryOperator *norab2 = buildNor(bo->getOperand(0), bo->getOperand(1), bo);
-  BinaryOperator *op = buildNor(norab, norab2, bo);
-  bo->replaceAllUsesWith(op);
+void SubstituteImpl::substituteSub(BinaryOperator *bo) {
+  if (MBATerms && substituteLinearMBA(bo))
+    return;
+  applyRandomRule(bo);
 }
-
-// Implementation of a = a | b => a = Nand(Nand(a, a), Nand(b, b))
-static void orNand(BinaryOperator *bo) {
-  BinaryOperator *nandaa = buildNand(bo->getOperand(0), bo->getOperand(0), bo);
-  BinaryOperator *nandbb = buildNand(bo->getOperand(1), bo->getOperand(1), bo);
-  BinaryOperator *op = buildNand(nandaa, nandbb, bo);
-  bo->replaceAllUsesWith(op);
+void SubstituteImpl::substituteAnd(BinaryOperator *bo) {
+  if (MBATerms && substituteLinearMBA(bo))
+    return;
+  applyRandomRule(bo);
 }
-
-// Implementation of a = a ^ b => a = (~a & b) | (a & ~b)
-static void xorSubstitution(BinaryOperator *bo) {
-  BinaryOperator *op = BinaryOperator::CreateNot(bo->getOperand(0), "", bo);
-  op = BinaryOperator::Create(Instruction::And, bo->getOperand(1), op, "", bo);
-  BinaryOperator *op1 = BinaryOperator::CreateNot(bo->getOperand(1), "", bo);
-  op1 =
-      BinaryOperator::Create(Instruction::And, bo->getOperand(0), op1, "", bo);
-  op = BinaryOperator::Create(Instruction::Or, op, op1, "", bo);
-  bo->replaceAllUsesWith(op);
+void SubstituteImpl::substituteOr(BinaryOperator *bo) {
+  if (MBATerms && substituteLinearMBA(bo))
+    return;
+  applyRandomRule(bo);
 }
-
-// Implementation of a = a ^ b => a = (b + c) - 2 * (b & c)
-static void xorSubstitution2(BinaryOperator *bo) {
-  ConstantInt *co = (ConstantInt *)ConstantInt::get(bo->getType(), 2);
-  BinaryOperator *op1 = BinaryOperator::Create(
-      Instruction::And, bo->getOperand(0), bo->getOperand(1), "", bo);
-  op1 = BinaryOperator::Create(Instruction::Mul, co, op1, "", bo);
-  BinaryOperator *op = BinaryOperator::Create(
-      Instruction::Add, bo->getOperand(0), bo->getOperand(1), "", bo);
-  op = BinaryOperator::Create(Instruction::Sub, op, op1, "", bo);
-  bo->replaceAllUsesWith(op);
+void SubstituteImpl::substituteXor(BinaryOperator *bo) {
+  if (MBATerms && substituteLinearMBA(bo))
+    return;
+  applyRandomRule(bo);
 }
+void SubstituteImpl::substituteMul(BinaryOperator *bo) {
+  applyRandomRule(bo);
+}
+
+// Linear Mixed Boolean-Arithmetic expressions
+//
+// A linear MBA expression is sum(a_i * e_i(x, y, ...)) where every e_i is a
+// bitwise expression. Since e_i acts on each bit on its own, the sum is equal
+// to a target expression for every input iff it is equal for the 2^n
+// combinations of a single bit of its n variables. Generating an identity
+// therefore comes down to solving a 2^n x 2^n linear system modulo 2^64,
+// which works for any bit width up to 64 as well.
+namespace {
+struct LinearMBA {
+  // Bit r of a truth table is the value of the bitwise expression for
+  // Vars[i] = (r >> i) & 1
+  static constexpr unsigned MaxVars = 3;
+  static constexpr unsigned MaxRows = 1 << MaxVars;
+  // Terms of more than two variables are picked among the cheap ones
+  static constexpr unsigned MaxTermCost = 2;
+
+  static unsigned numRows(unsigned NumVars) { return 1 << NumVars; }
+  static unsigned allOnes(unsigned NumVars) {
+    return (1 << numRows(NumVars)) - 1;
+  }
 
-// Implementation of a = a ^ b => a = b - (2 * (c & ~(b ^ c)) - c)
-static void xorSubstitution3(BinaryOperator *bo) {
-  ConstantInt *co = (ConstantInt *)ConstantInt::get(bo->getType(), 2);
-  BinaryOperator *op1 = BinaryOperator::Create(
-      Instruction::Xor, bo->getOperand(0), bo->getOperand(1), "", bo);
-  op1 = BinaryOperator::CreateNot(op1, "", bo);
-  op1 =
-      BinaryOperator::Create(Instruction::And, bo->getOperand(1), op1, "", bo);
-  op1 = BinaryOperator::Create(Instruction::Mul, co, op1, "", bo);
-  op1 =
-      BinaryOperator::Create(Instruction::Sub, op1, bo->getOperand(1), "", bo);
-  BinaryOperator *op =
-      BinaryOperator::Create(Instruction::Sub, bo->getOperand(0), op1, "", bo);
-  bo->replaceAllUsesWith(op);
-}
+  // Returns false if the terms can't be solved from the chosen basis
+  static bool solve(std::map<unsigned, uint64_t> &Terms,
+                    const uint64_t Target[], unsigned NumVars) {
+    unsigned NumRows = numRows(NumVars);
+    uint64_t Residual[MaxRows];
+    for (unsigned r = 0; r < NumRows; r++) {
+      Residual[r] = Target[r];
+      for (const std::pair<const unsigned, uint64_t> &T : Terms)
+        if ((T.first >> r) & 1)
+          Residual[r] -= T.second;
+    }
+    // Pick a random basis of truth tables and solve Basis * c = Residual
+    unsigned Basis[MaxRows];
+    uint64_t Mat[MaxRows][MaxRows + 1];
+    for (unsigned i = 0; i < NumRows; i++)
+      Basis[i] = randomTruth(NumVars);
+    for (unsigned r = 0; r < NumRows; r++) {
+      for (unsigned c = 0; c < NumRows; c++)
+        Mat[r][c] = (Basis[c] >> r) & 1;
+      Mat[r][NumRows] = Residual[r];
+    }
+    // Gauss-Jordan elimination modulo 2^64, the matrix is invertible iff an
+    // odd pivot can be found for every column
+    for (unsigned c = 0; c < NumRows; c++) {
+      unsigned p = c;
+      while (p < NumRows && !(Mat[p][c] & 1))
+        p++;
+      if (p == NumRows)
+        return false;
+      std::swap(Mat[p], Mat[c]);
+      uint64_t Inv = Mat[c][c];
+      for (unsigned i = 0; i < 5; i++)
+        Inv *= 2 - Mat[c][c] * Inv;
+      for (unsigned k = 0; k <= NumRows; k++)
+        Mat[c][k] *= Inv;
+      for (unsigned r = 0; r < NumRows; r++)
+        if (r != c && Mat[r][c]) {
+          uint64_t F = Mat[r][c];
+          for (unsigned k = 0; k <= NumRows; k++)
+            Mat[r][k] -= F * Mat[c][k];
+        }
+    }
+    for (unsigned c = 0; c < NumRows; c++)
+      Terms[Basis[c]] += Mat[c][NumRows];
+    return true;
+  }
 
-// Implementation of a = a ^ b <=> (a ^ r) ^ (b ^ r) <=> (~a & r | a & ~r) ^ (~b
-// & r | b & ~r) note : r is a random number
-static void xorSubstitutionRand(BinaryOperator *bo) {
-  ConstantInt *co = (ConstantInt *)ConstantInt::get(
-      bo->getType(), cryptoutils->get_uint64_t());
-  BinaryOperator *op = BinaryOperator::CreateNot(bo->getOperand(0), "", bo);
-  op = BinaryOperator::Create(Instruction::And, co, op, "", bo);
-  BinaryOperator *opr = BinaryOperator::CreateNot(co, "", bo);
-  BinaryOperator *op1 =
-      BinaryOperator::Create(Instruction::And, bo->getOperand(0), opr, "", bo);
-  BinaryOperator *op2 = BinaryOperator::CreateNot(bo->getOperand(1), "", bo);
-  op2 = BinaryOperator::Create(Instruction::And, op2, co, "", bo);
-  BinaryOperator *op3 =
-      BinaryOperator::Create(Instruction::And, bo->getOperand(1), opr, "", bo);
-  op = BinaryOperator::Create(Instruction::Or, op, op1, "", bo);
-  op1 = BinaryOperator::Create(Instruction::Or, op2, op3, "", bo);
-  op = BinaryOperator::Create(Instruction::Xor, op, op1, "", bo);
-  bo->replaceAllUsesWith(op);
-}
+  // Truth tables of more variables are split on the last one as
+  // f = f0 ^ (v & (f0 ^ f1)), bitwiseCost mirrors buildBitwise
+  static unsigned bitwiseCost(unsigned Truth, unsigned NumVars) {
+    if (NumVars == 2)
+      switch (Truth) {
+      case 0b1010:
+      case 0b1100:
+        return 0;
+      case 0b0011:
+      case 0b0101:
+      case 0b0110:
+      case 0b1000:
+      case 0b1110:
+        return 1;
+      default:
+        return 2;
+      }
+    unsigned HalfOnes = allOnes(NumVars - 1);
+    unsigned Lo = Truth & HalfOnes,
+             H = (Truth >> numRows(NumVars - 1)) ^ Lo;
+    if (!H)
+      return bitwiseCost(Lo, NumVars - 1);
+    unsigned Cost = H == HalfOnes ? 0 : bitwiseCost(H, NumVars - 1) + 1;
+    if (!Lo)
+      return Cost;
+    if (Lo == HalfOnes)
+      return Cost + 1;
+    return bitwiseCost(Lo, NumVars - 1) + Cost + 1;
+  }
 
-// Implementation of a = a ^ b => a = Nor(Nor(Nor(a, a), Nor(b, b)), Nor(a, b))
-static void xorNor(BinaryOperator *bo) {
-  BinaryOperator *noraa = buildNor(bo->getOperand(0), bo->getOperand(0), bo);
-  BinaryOperator *norbb = buildNor(bo->getOperand(1), bo->getOperand(1), bo);
-  BinaryOperator *nornoraanorbb = buildNor(noraa, norbb, bo);
-  BinaryOperator *norab = buildNor(bo->getOperand(0), bo->getOperand(1), bo);
-  BinaryOperator *op = buildNor(nornoraanorbb, norab, bo);
-  bo->replaceAllUsesWith(op);
-}
+  static Value *buildBitwise(unsigned Truth, ArrayRef<Value *> Vars,
+                             IRBuilder<NoFolder> &IRB) {
+    if (Vars.size() > 2) {
+      unsigned NumVars = Vars.size(), HalfOnes = allOnes(NumVars - 1);
+      unsigned Lo = Truth & HalfOnes,
+               H = (Truth >> numRows(NumVars - 1)) ^ Lo;
+      ArrayRef<Value *> Rest = Vars.drop_back();
+      if (!H)
+        return buildBitwise(Lo, Rest, IRB);
+      Value *VH = H == HalfOnes
+                      ? Vars.back()
+                      : IRB.CreateAnd(Vars.back(), buildBitwise(H, Rest, IRB));
+      if (!Lo)
+        return VH;
+      if (Lo == HalfOnes)
+        return IRB.CreateNot(VH);
+      return IRB.CreateXor(buildBitwise(Lo, Rest, IRB), VH);
+    }
+    Value *x = Vars[0], *y = Vars[1];
+    switch (Truth) {
+    case 0b0001:
+      return IRB.CreateNot(IRB.CreateOr(x, y));
+    case 0b0010:
+      return IRB.CreateAnd(x, IRB.CreateNot(y));
+    case 0b0011:
+      return IRB.CreateNot(y);
+    case 0b0100:
+      return IRB.CreateAnd(IRB.CreateNot(x), y);
+    case 0b0101:
+      return IRB.CreateNot(x);
+    case 0b0110:
+      return IRB.CreateXor(x, y);
+    case 0b0111:
+      return IRB.CreateNot(IRB.CreateAnd(x, y));
+    case 0b1000:
+      return IRB.CreateAnd(x, y);
+    case 0b1001:
+      return IRB.CreateNot(IRB.CreateXor(x, y));
+    case 0b1010:
+      return x;
+    case 0b1011:
+      return IRB.CreateOr(x, IRB.CreateNot(y));
+    case 0b1100:
+      return y;
+    case 0b1101:
+      return IRB.CreateOr(IRB.CreateNot(x), y);
+    case 0b1110:
+      return IRB.CreateOr(x, y);
+    default:
+      llvm_unreachable("Not a non-constant bitwise function");
+    }
+  }
 
-// Implementation of a = a ^ b => a = Nand(Nand(Nand(a, a), b), Nand(a, Nand(b,
-// b)))
-static void xorNand(BinaryOperator *bo) {
-  BinaryOperator *nandaa = buildNand(bo->getOperand(0), bo->getOperand(0), bo);
-  BinaryOperator *nandnandaab = buildNand(nandaa, bo->getOperand(1), bo);
-  BinaryOperator *nandbb = buildNand(bo->getOperand(1), bo->getOperand(1), bo);
-  BinaryOperator *nandanandbb = buildNand(bo->getOperand(0), nandbb, bo);
-  BinaryOperator *op = buildNand(nandnandaab, nandanandbb, bo);
-  bo->replaceAllUsesWith(op);
-}
+  // Any non-zero truth table of two variables, cheap ones of more
+  static unsigned randomTruth(unsigned NumVars) {
+    unsigned Truth;
+    do
+      Truth = cryptoutils->get_range(1, allOnes(NumVars) + 1);
+    while (Truth != allOnes(NumVars) &&
+           bitwiseCost(Truth, NumVars) > MaxTermCost);
+    return Truth;
+  }
 
-// Implementation of a = b * c => a = (((b | c) * (b & c)) + ((b & ~c) * (c &
-// ~b)))
-static void mulSubstitution(BinaryOperator *bo) {
-  BinaryOperator *op1 = BinaryOperator::CreateNot(bo->getOperand(0), "", bo);
-  op1 =
-      BinaryOperator::Create(Instruction::And, bo->getOperand(1), op1, "", bo);
-  BinaryOperator *op2 = BinaryOperator::CreateNot(bo->getOperand(1), "", bo);
-  op2 =
-      BinaryOperator::Create(Instruction::And, bo->getOperand(0), op2, "", bo);
-  BinaryOperator *op =
-      BinaryOperator::Create(Instruction::Mul, op2, op1, "", bo);
-  op1 = BinaryOperator::Create(Instruction::And, bo->getOperand(0),
-                               bo->getOperand(1), "", bo);
-  op2 = BinaryOperator::Create(Instruction::Or, bo->getOperand(0),
-                               bo->getOperand(1), "", bo);
-  BinaryOperator *op3 =
-      BinaryOperator::Create(Instruction::Mul, op2, op1, "", bo);
-  op = BinaryOperator::Create(Instruction::Add, op3, op, "", bo);
-  bo->replaceAllUsesWith(op);
-}
+  // Emit sum(a_i * e_i(Vars)) equal to Target before InsertBefore
+  static Value *build(const uint64_t Target[], ArrayRef<Value *> Vars,
+                      unsigned NumTerms, Instruction *InsertBefore) {
+    Type *Ty = Vars[0]->getType();
+    unsigned BitWidth = Ty->getScalarSizeInBits();
+    unsigned NumVars = Vars.size();
+    std::map<unsigned /*truth table*/, uint64_t /*coefficient*/> Terms;
+    do {
+      Terms.clear();
+      for (unsigned i = numRows(NumVars); i < NumTerms; i++)
+        Terms[randomTruth(NumVars)] += cryptoutils->get_uint64_t();
+    } while (!solve(Terms, Target, NumVars));
+
+    std::vector<std::pair<unsigned, uint64_t>> Shuffled;
+    for (const std::pair<const unsigned, uint64_t> &T : Terms)
+      if (APInt(BitWidth, T.second) != 0)
+        Shuffled.emplace_back(T);
+    for (unsigned i = Shuffled.size(); i > 1; i--)
+      std::swap(Shuffled[i - 1], Shuffled[cryptoutils->get_range(i)]);
+
+    IRBuilder<NoFolder> IRB(InsertBefore);
+    // Terms with a coefficient of -1 are subtracted
+    SmallVector<std::pair<Value *, bool /*negated*/>, 16> Sums;
+    uint64_t Const = 0;
+    for (const std::pair<unsigned, uint64_t> &T : Shuffled) {
+      // ~0 is -1 on every bit width, keep it out of the expression
+      if (T.first == allOnes(NumVars)) {
+        Const -= T.second;
+        continue;
+      }
+      APInt Coeff(BitWidth, T.second);
+      Value *E = buildBitwise(T.first, Vars, IRB);
+      if (!Coeff.isOne() && !Coeff.isAllOnes())
+        E = IRB.CreateMul(E, ConstantInt::get(Ty, Coeff));
+      Sums.emplace_back(E, Coeff.isAllOnes());
+    }
+    if (APInt(BitWidth, Const) != 0 || Sums.empty())
+      Sums.insert(Sums.begin() + cryptoutils->get_range(Sums.size() + 1),
+                  {ConstantInt::get(Ty, APInt(BitWidth, Const)), false});
+    // Add up pairwise so that the sum is only log2(terms) deep
+    while (Sums.size() > 1) {
+      SmallVector<std::pair<Value *, bool>, 16> Next;
+      for (unsigned i = 0; i + 1 < Sums.size(); i += 2) {
+        std::pair<Value *, bool> &A = Sums[i], &B = Sums[i + 1];
+        if (A.second == B.second)
+          Next.emplace_back(IRB.CreateAdd(A.first, B.first), A.second);
+        else if (B.second)
+          Next.emplace_back(IRB.CreateSub(A.first, B.first), false);
+        else
+          Next.emplace_back(IRB.CreateSub(B.first, A.first), false);
+      }
+      if (Sums.size() & 1)
+        Next.push_back(Sums.back());
+      Sums = std::move(Next);
+    }
+    return Sums[0].second ? IRB.CreateNeg(Sums[0].first) : Sums[0].first;
+  }
+};
+} // namespace
+
+// Implementation of a = b op c => a = sum(a_i * e_i(b, c))
+static bool substituteLinearMBA(BinaryOperator *bo) {
+  // Coefficients are solved modulo 2^64
+  if (bo->getType()->getScalarSizeInBits() > 64)
+    return false;
+  uint64_t Target[LinearMBA::MaxRows];
+  for (unsigned r = 0; r < LinearMBA::numRows(2); r++) {
+    uint64_t x = r & 1, y = (r >> 1) & 1;
+    switch (bo->getOpcode()) {
+    case Instruction::Add:
+      Target[r] = x + y;
+      break;
+    case Instruction::Sub:
+      Target[r] = x - y;
+      break;
+    case Instruction::And:
+      Target[r] = x & y;
+      break;
+    case Instruction::Or:
+      Target[r] = x | y;
+      break;
+    case Instruction::Xor:
+      Target[r] = x ^ y;
+      break;
+    default:
+      return false;
+    }
+  }
+  Value *Vars[] = {bo->getOperand(0), bo->getOperand(1)};
+  Instruction *Prev = bo->getPrevNode();
+  bo->replaceAllUsesWith(LinearMBA::build(Target, Vars, MBATerms, bo));
+  interleaveInserted(getInserted(Prev, bo));
+  return true;
+}
+
+// Integer expression trees
+//
+// A tree of single-use add, sub, and, or and xor instructions of one block,
+// where no bitwise operation uses the result of an arithmetic one, is a
+// linear MBA expression of its leaves. Rewriting it as one generated
+// expression avoids expanding every instruction of a chain on its own. Trees
+// are cut so that they have at most LinearMBA::MaxVars leaves.
+static bool isBitwiseOp(unsigned Opcode) {
+  return Opcode == Instruction::And || Opcode == Instruction::Or ||
+         Opcode == Instruction::Xor;
+}
+
+static bool isTreeOp(unsigned Opcode) {
+  return Opcode == Instruction::Add || Opcode == Instruction::Sub ||
+         isBitwiseOp(Opcode);
+}
+
+// Whether V can be inlined into the tree of its user Parent
+static bool canBeInterior(Value *V, BinaryOperator *Parent) {
+  BinaryOperator *bo = dyn_cast<BinaryOperator>(V);
+  return bo && isTreeOp(bo->getOpcode()) && bo->hasOneUse() &&
+         bo->getParent() == Parent->getParent() &&
+         (!isBitwiseOp(Parent->getOpcode()) || isBitwiseOp(bo->getOpcode()));
+}
+
+// Constants that are folded into the truth table instead of taking a leaf.
+// As a term of an add/sub, c is -c * ~0, in a bitwise operation only 0 and ~0
+// have the same value on every bit.
+static bool getConstantRow(Value *V, BinaryOperator *Parent, uint64_t &Row) {
+  const APInt *C;
+  if (isBitwiseOp(Parent->getOpcode())) {
+    if (!match(V, m_CombineOr(m_Zero(), m_AllOnes())))
+      return false;
+    Row = match(V, m_AllOnes());
+    return true;
+  }
+  if (!match(V, m_APInt(C)))
+    return false;
+  Row = -C->getSExtValue();
+  return true;
+}
+
+namespace {
+struct ExpressionTree {
+  // In post-order, the root is the last node
+  SmallVector<BinaryOperator *, 8> Nodes;
+  SmallSetVector<Value *, 4> Leaves;
+  // Subtrees that had to be left as leaves
+  SmallVector<BinaryOperator *, 4> Cut;
+
+  static constexpr unsigned MaxDepth = 16;
+
+  static ExpressionTree collect(BinaryOperator *Node, unsigned Depth = 0) {
+    // Every operand on its own either as a subtree or as a leaf
+    ExpressionTree Sub[2], Leaf[2];
+    bool CanMerge[2];
+    for (unsigned i = 0; i < 2; i++) {
+      Value *V = Node->getOperand(i);
+      uint64_t Row;
+      if (!getConstantRow(V, Node, Row))
+        Leaf[i].Leaves.insert(V);
+      if (!canBeInterior(V, Node)) {
+        CanMerge[i] = false;
+        continue;
+      }
+      Leaf[i].Cut.push_back(cast<BinaryOperator>(V));
+      CanMerge[i] = Depth < MaxDepth;
+      if (CanMerge[i])
+        Sub[i] = collect(cast<BinaryOperator>(V), Depth + 1);
+    }
+    // Prefer the largest tree that fits
+    ExpressionTree T;
+    for (unsigned Choice : {3, 1, 2, 0}) {
+      ExpressionTree &A = (Choice & 1) && CanMerge[0] ? Sub[0] : Leaf[0];
+      ExpressionTree &B = (Choice & 2) && CanMerge[1] ? Sub[1] : Leaf[1];
+      SmallSetVector<Value *, 4> Leaves(A.Leaves.begin(), A.Leaves.end());
+      Leaves.insert(B.Leaves.begin(), B.Leaves.end());
+      if (Leaves.size() > LinearMBA::MaxVars)
+        continue;
+      T.Nodes.append(A.Nodes.begin(), A.Nodes.end());
+      T.Nodes.append(B.Nodes.begin(), B.Nodes.end());
+      T.Nodes.push_back(Node);
+      T.Leaves = std::move(Leaves);
+      T.Cut.append(A.Cut.begin(), A.Cut.end());
+      T.Cut.append(B.Cut.begin(), B.Cut.end());
+      break;
+    }
+    return T;
+  }
 
-// Implementation of a = b * c => a = (((b | c) * (b & c)) + ((~(b | ~c)) * (b &
-// ~c)))
-static void mulSubstitution2(BinaryOperator *bo) {
-  BinaryOperator *op1 = BinaryOperator::CreateNot(bo->getOperand(1), "", bo);
-  BinaryOperator *op2 =
-      BinaryOperator::Create(Instruction::And, bo->getOperand(0), op1, "", bo);
-  BinaryOperator *op3 =
-      BinaryOperator::Create(Instruction::Or, bo->getOperand(0), op1, "", bo);
-  op3 = BinaryOperator::CreateNot(op3, "", bo);
-  op3 = BinaryOperator::Create(Instruction::Mul, op3, op2, "", bo);
-  BinaryOperator *op4 = BinaryOperator::Create(
-      Instruction::And, bo->getOperand(0), bo->getOperand(1), "", bo);
-  BinaryOperator *op5 = BinaryOperator::Create(
-      Instruction::Or, bo->getOperand(0), bo->getOperand(1), "", bo);
-  op5 = BinaryOperator::Create(Instruction::Mul, op5, op4, "", bo);
-  BinaryOperator *op =
-      BinaryOperator::Create(Instruction::Add, op5, op3, "", bo);
-  bo->replaceAllUsesWith(op);
+  uint64_t evaluate(unsigned Row) const {
+    DenseMap<Value *, uint64_t> Values;
+    for (unsigned i = 0; i < Leaves.size(); i++)
+      Values[Leaves[i]] = (Row >> i) & 1;
+    for (BinaryOperator *Node : Nodes) {
+      uint64_t Ops[2];
+      for (unsigned i = 0; i < 2; i++) {
+        Value *V = Node->getOperand(i);
+        auto It = Values.find(V);
+        if (It != Values.end())
+          Ops[i] = It->second;
+        else
+          getConstantRow(V, Node, Ops[i]);
+      }
+      switch (Node->getOpcode()) {
+      case Instruction::Add:
+        Values[Node] = Ops[0] + Ops[1];
+        break;
+      case Instruction::Sub:
+        Values[Node] = Ops[0] - Ops[1];
+        break;
+      case Instruction::And:
+        Values[Node] = Ops[0] & Ops[1];
+        break;
+      case Instruction::Or:
+        Values[Node] = Ops[0] | Ops[1];
+        break;
+      case Instruction::Xor:
+        Values[Node] = Ops[0] ^ Ops[1];
+        break;
+      default:
+        llvm_unreachable("Not an expression tree operation");
+      }
+    }
+    return Values[Nodes.back()];
+  }
+};
+} // namespace
+
+bool SubstituteImpl::isExpressionTreeInterior(BinaryOperator *bo) {
+  if (!bo->hasOneUse())
+    return false;
+  BinaryOperator *User = dyn_cast<BinaryOperator>(bo->user_back());
+  return User && isTreeOp(User->getOpcode()) && canBeInterior(bo, User);
+}
+
+bool SubstituteImpl::substituteExpressionTree(BinaryOperator *Root) {
+  // Coefficients are solved modulo 2^64
+  if (!isTreeOp(Root->getOpcode()) ||
+      Root->getType()->getScalarSizeInBits() > 64)
+    return false;
+  std::vector<BinaryOperator *> Worklist = {Root};
+  while (!Worklist.empty()) {
+    ExpressionTree T = ExpressionTree::collect(Worklist.back());
+    Worklist.pop_back();
+    Worklist.insert(Worklist.end(), T.Cut.begin(), T.Cut.end());
+    // Pad with the first leaf, an identity of independent variables still
+    // holds if they are equal
+    SmallVector<Value *, LinearMBA::MaxVars> Vars(T.Leaves.begin(),
+                                                  T.Leaves.end());
+    if (Vars.empty())
+      continue;
+    while (Vars.size() < 2)
+      Vars.push_back(Vars[0]);
+    unsigned NumRows = LinearMBA::numRows(Vars.size());
+    uint64_t Target[LinearMBA::MaxRows];
+    for (unsigned r = 0; r < NumRows; r++)
+      Target[r] = T.evaluate(r);
+    BinaryOperator *Node = T.Nodes.back();
+    Instruction *Prev = Node->getPrevNode();
+    Node->replaceAllUsesWith(LinearMBA::build(
+        Target, Vars, std::max<unsigned>(MBATerms, NumRows), Node));
+    SmallVector<Instruction *, 16> Seq = getInserted(Prev, Node);
+    for (auto I = T.Nodes.rbegin(), E = T.Nodes.rend(); I != E; ++I)
+      (*I)->eraseFromParent();
+    interleaveInserted(Seq);
+  }
+  return true;
 }
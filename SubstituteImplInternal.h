@@ -0,0 +1,39 @@
+// For open-source license, please refer to
+// [License](https://github.com/HikariObfuscator/Hikari/wiki/License).
+//===----------------------------------------------------------------------===//
+//
+// Parts of SubstituteImpl shared with the passes of this library that are not
+// part of the public SubstituteImpl.h interface.
+//
+//===----------------------------------------------------------------------===//
+#ifndef LLVM_LIB_TRANSFORMS_OBFUSCATION_SUBSTITUTEIMPLINTERNAL_H
+#define LLVM_LIB_TRANSFORMS_OBFUSCATION_SUBSTITUTEIMPLINTERNAL_H
+
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/InstrTypes.h"
+
+namespace llvm {
+namespace SubstituteImpl {
+// Fixed-point one of the frequency weights of substituteWithinBudget
+const uint64_t FreqScale = 1 << 10;
+// Substitute bo with a rewrite whose extra latency estimated by TTI, scaled by
+// Weight / FreqScale, fits into Budget and deduct it. With PreferCheap only the
+// cheapest fitting rewrites are considered, with VectorFriendly only those
+// accepted by substituteVectorFriendly. Returns false if nothing fits.
+bool substituteWithinBudget(BinaryOperator *bo, const TargetTransformInfo &TTI,
+                            uint64_t Weight, InstructionCost &Budget,
+                            bool PreferCheap, bool VectorFriendly = false);
+// Substitute bo with a lane-wise rewrite that keeps vector code efficient on
+// SSE/AVX2/NEON. Returns false if there is none for the opcode of bo.
+bool substituteVectorFriendly(BinaryOperator *bo);
+// Whether bo is inlined into the expression tree of its only user, it is
+// substituted together with the root of that tree.
+bool isExpressionTreeInterior(BinaryOperator *bo);
+// Replace the tree of single-use add, sub, and, or and xor instructions below
+// Root with one linear MBA expression of its leaves and erase it. Returns
+// false if Root is not such an instruction.
+bool substituteExpressionTree(BinaryOperator *Root);
+} // namespace SubstituteImpl
+} // namespace llvm
+
+#endif
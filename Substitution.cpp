@@ -2,13 +2,20 @@
 // [License](https://github.com/HikariObfuscator/Hikari/wiki/License).
 //===----------------------------------------------------------------------===//
 #include "llvm/Transforms/Obfuscation/Substitution.h"
+#include "SubstituteImplInternal.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ScaledNumber.h"
 #include "llvm/Transforms/Obfuscation/CryptoUtils.h"
 #include "llvm/Transforms/Obfuscation/SubstituteImpl.h"
 #include "llvm/Transforms/Obfuscation/Utils.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
 
 using namespace llvm;
 
@@ -23,6 +30,31 @@ static cl::opt<unsigned int>
                 cl::desc("Choose the probability [%] each instructions will be "
                          "obfuscated by the InstructionSubstitution pass"),
                 cl::value_desc("probability rate"), cl::init(50), cl::Optional);
+static cl::opt<unsigned int> MaxCycles(
+    "sub_max_cycles",
+    cl::desc("Budget of extra latency per function, weighted by the estimated "
+             "block frequency, that substitutions may add. Cheap rewrites are "
+             "preferred in hot blocks. 0 means no limit"),
+    cl::value_desc("cycles"), cl::init(0), cl::Optional);
+static cl::opt<bool> VectorizeSafe(
+    "sub_vectorize_safe",
+    cl::desc("Only use lane-wise rewrites without vector multiplies or "
+             "constant splats on vector operations, for running after the "
+             "loop vectorizer"),
+    cl::init(false), cl::Optional);
+static cl::opt<bool> BeforeVectorizer(
+    "sub_before_vectorizer",
+    cl::desc("With -sub_vectorize_safe, the pass runs before the loop "
+             "vectorizer: also leave innermost loops it may still transform "
+             "untouched"),
+    cl::init(false), cl::Optional);
+static cl::opt<bool> ExpressionTrees(
+    "sub_tree",
+    cl::desc("Substitute whole trees of single-use add, sub, and, or and xor "
+             "instructions with one linear Mixed Boolean-Arithmetic "
+             "expression of their leaves, of at least -sub_mba_terms terms. "
+             "Ignored with -sub_max_cycles"),
+    cl::init(false), cl::Optional);
 
 // Stats
 STATISTIC(Add, "Add substitued");
@@ -34,6 +66,8 @@ STATISTIC(Mul, "Mul substitued");
 STATISTIC(And, "And substitued");
 STATISTIC(Or, "Or substitued");
 STATISTIC(Xor, "Xor substitued");
+STATISTIC(Vec, "Vector operations substitued");
+STATISTIC(Tree, "Expression trees substitued");
 
 namespace {
 
@@ -54,6 +88,13 @@ struct Substitution : public FunctionPass {
                 "-sub_prob=x must be 0 < x <= 100";
       return false;
     }
+    // The budget only knows the cost of single substitutions
+    static bool WarnedTreesWithinBudget = false;
+    if (MaxCycles && ExpressionTrees && !WarnedTreesWithinBudget) {
+      errs() << "InstructionSubstitution -sub_tree is ignored with "
+                "-sub_max_cycles\n";
+      WarnedTreesWithinBudget = true;
+    }
 
     Function *tmp = &F;
     // Do we obfuscate
@@ -66,11 +107,31 @@ struct Substitution : public FunctionPass {
     return false;
   };
   bool substitute(Function *f) {
+    if (MaxCycles)
+      return substituteWithinBudget(f);
+    if (ExpressionTrees)
+      return substituteExpressionTrees(f);
     // Loop for the number of time we run the pass on the function
+    std::unique_ptr<DominatorTree> DT;
+    std::unique_ptr<LoopInfo> LI;
+    if (VectorizeSafe) {
+      DT = std::make_unique<DominatorTree>(*f);
+      LI = std::make_unique<LoopInfo>(*DT);
+    }
     int times = ObfTimes;
     do {
       for (Instruction &inst : instructions(f))
         if (inst.isBinaryOp() && cryptoutils->get_range(100) <= ObfProbRate) {
+          if (VectorizeSafe) {
+            if (isLeftToVectorizer(inst, *LI))
+              continue;
+            if (inst.getType()->isVectorTy()) {
+              if (SubstituteImpl::substituteVectorFriendly(
+                      cast<BinaryOperator>(&inst)))
+                ++Vec;
+              continue;
+            }
+          }
           switch (inst.getOpcode()) {
           case BinaryOperator::Add:
             // case BinaryOperator::FAdd:
@@ -125,6 +186,132 @@ struct Substitution : public FunctionPass {
     } while (--times); // for times
     return true;
   }
+
+  /* substituteExpressionTrees
+   *
+   * Every tree is substituted through its root, instructions inlined into a
+   * tree are left to it. Mul is not part of any tree and keeps its
+   * substitutions.
+   */
+  bool substituteExpressionTrees(Function *f) {
+    std::unique_ptr<DominatorTree> DT;
+    std::unique_ptr<LoopInfo> LI;
+    if (VectorizeSafe) {
+      DT = std::make_unique<DominatorTree>(*f);
+      LI = std::make_unique<LoopInfo>(*DT);
+    }
+    int times = ObfTimes;
+    do {
+      std::vector<BinaryOperator *> roots;
+      for (Instruction &inst : instructions(f))
+        if (BinaryOperator *bo = dyn_cast<BinaryOperator>(&inst))
+          if (!SubstituteImpl::isExpressionTreeInterior(bo) &&
+              cryptoutils->get_range(100) <= ObfProbRate &&
+              !(VectorizeSafe && (isLeftToVectorizer(inst, *LI) ||
+                                  inst.getType()->isVectorTy())))
+            roots.emplace_back(bo);
+      for (BinaryOperator *bo : roots)
+        if (SubstituteImpl::substituteExpressionTree(bo))
+          ++Tree;
+        else if (bo->getOpcode() == Instruction::Mul) {
+          SubstituteImpl::substituteMul(bo);
+          ++Mul;
+        }
+    } while (--times);
+    return true;
+  }
+
+  /* isLeftToVectorizer
+   *
+   * With -sub_before_vectorizer, scalar code of an innermost loop that is
+   * neither vectorized yet nor excluded from the vectorizer by metadata is
+   * kept as is so that the loop can still be vectorized. After the
+   * vectorizer every loop it left scalar was rejected or is a remainder and
+   * is substituted as usual.
+   */
+  static bool isLeftToVectorizer(Instruction &inst, LoopInfo &LI) {
+    if (!BeforeVectorizer)
+      return false;
+    Loop *L = LI.getLoopFor(inst.getParent());
+    return L && L->isInnermost() && !inst.getType()->isVectorTy() &&
+           !(hasVectorizeTransformation(L) & TM_Disable);
+  }
+
+  /* substituteWithinBudget
+   *
+   * Spend the -sub_max_cycles budget starting with the coldest blocks, where
+   * extra latency is cheapest, and only use the cheapest rewrites in blocks
+   * that run more often than the entry block.
+   */
+  bool substituteWithinBudget(Function *f) {
+    // Use the target's cost model when running inside a legacy pass manager
+    TargetTransformInfo DefaultTTI(f->getParent()->getDataLayout());
+    const TargetTransformInfo *TTI = &DefaultTTI;
+    if (TargetTransformInfoWrapperPass *TTIWP =
+            getResolver()
+                ? getAnalysisIfAvailable<TargetTransformInfoWrapperPass>()
+                : nullptr)
+      TTI = &TTIWP->getTTI(*f);
+    DominatorTree DT(*f);
+    LoopInfo LI(DT);
+    BranchProbabilityInfo BPI(*f, LI);
+    BlockFrequencyInfo BFI(*f, BPI, LI);
+    uint64_t EntryFreq = std::max<uint64_t>(BFI.getEntryFreq(), 1);
+    InstructionCost Budget = (int64_t)MaxCycles;
+    int times = ObfTimes;
+    do {
+      std::vector<std::pair<uint64_t /*freq*/, BinaryOperator *>> candidates;
+      for (Instruction &inst : instructions(f))
+        if (inst.isBinaryOp() && cryptoutils->get_range(100) <= ObfProbRate &&
+            !(VectorizeSafe && isLeftToVectorizer(inst, LI)))
+          candidates.emplace_back(
+              BFI.getBlockFreq(inst.getParent()).getFrequency(),
+              cast<BinaryOperator>(&inst));
+      std::stable_sort(candidates.begin(), candidates.end(),
+                       [](const std::pair<uint64_t, BinaryOperator *> &a,
+                          const std::pair<uint64_t, BinaryOperator *> &b) {
+                         return a.first < b.first;
+                       });
+      for (std::pair<uint64_t, BinaryOperator *> &candidate : candidates) {
+        BinaryOperator *bo = candidate.second;
+        unsigned opcode = bo->getOpcode();
+        bool isVector = VectorizeSafe && bo->getType()->isVectorTy();
+        // Frequency relative to the entry block in fixed point
+        uint64_t Weight =
+            ScaledNumber<uint64_t>::getFraction(candidate.first, EntryFreq)
+                .scale(SubstituteImpl::FreqScale);
+        if (!SubstituteImpl::substituteWithinBudget(
+                bo, *TTI, Weight, Budget, candidate.first > EntryFreq,
+                isVector))
+          continue;
+        if (isVector)
+          ++Vec;
+        switch (opcode) {
+        case BinaryOperator::Add:
+          ++Add;
+          break;
+        case BinaryOperator::Sub:
+          ++Sub;
+          break;
+        case BinaryOperator::Mul:
+          ++Mul;
+          break;
+        case Instruction::And:
+          ++And;
+          break;
+        case Instruction::Or:
+          ++Or;
+          break;
+        case Instruction::Xor:
+          ++Xor;
+          break;
+        default:
+          break;
+        }
+      }
+    } while (--times);
+    return true;
+  }
 };
 } // namespace
 
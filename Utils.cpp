@@ -281,7 +281,13 @@ void writeAnnotate(Function *f, std::string annotation) {
         Constant *newCA = ConstantArray::get(
             ArrayType::get(Annotations[0]->getType(), Annotations.size()),
             Annotations);
-        glob->setInitializer(newCA);
+        // The array grew, so its type no longer matches the old global
+        GlobalVariable *newGV = new GlobalVariable(
+            *M, newCA->getType(), false, GlobalValue::AppendingLinkage, newCA,
+            "");
+        newGV->setSection("llvm.metadata");
+        newGV->takeName(glob);
+        glob->eraseFromParent();
       }
     }
   } else {
@@ -0,0 +1,39 @@
+; RUN: opt -passes='hikari,loop-vectorize' -enable-subobf -sub_prob=100 \
+; RUN:   -sub_vectorize_safe -sub_before_vectorizer \
+; RUN:   -force-vector-width=4 -pass-remarks=loop-vectorize \
+; RUN:   -disable-output %s 2>&1 | FileCheck %s
+; RUN: opt -passes='function(loop-vectorize),hikari' -enable-subobf \
+; RUN:   -sub_prob=100 -sub_vectorize_safe -force-vector-width=4 -S %s \
+; RUN:   | FileCheck %s --check-prefix=AFTER
+
+; Run before the vectorizer the loop is left to it and still vectorized.
+; CHECK: remark: {{.*}}vectorized loop (vectorization width: 4
+
+; Run after it the vector body keeps lane-wise code without a vector multiply
+; and the scalar remainder loop the vectorizer left is substituted as usual.
+; AFTER-LABEL: vector.body:
+; AFTER-NOT: mul <4 x i32>
+; AFTER: middle.block:
+; AFTER-LABEL: loop:
+; AFTER: store i32 %{{[0-9]+}}, i32* %pa
+
+define void @add(i32* noalias %a, i32* noalias %b, i32* noalias %c, i64 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %pb = getelementptr inbounds i32, i32* %b, i64 %i
+  %vb = load i32, i32* %pb, align 4
+  %pc = getelementptr inbounds i32, i32* %c, i64 %i
+  %vc = load i32, i32* %pc, align 4
+  %sum = add i32 %vb, %vc
+  %pa = getelementptr inbounds i32, i32* %a, i64 %i
+  store i32 %sum, i32* %pa, align 4
+  %i.next = add nuw nsw i64 %i, 1
+  %done = icmp eq i64 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret void
+}